@@ -0,0 +1,125 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_BLOOM_FILTER_HPP__
+#define __QUORUM_BLOOM_FILTER_HPP__
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/hyperloglog.hpp>
+
+// Blocked Bloom filter of k-mers. All the bits of a k-mer are in the
+// same 512 bit block, i.e. one cache line, so a query or an insertion
+// costs one cache miss. Insertions are thread safe.
+//
+// Binary form: the number of blocks, the number of hashes and the
+// words of the blocks, as 64 bit words.
+class bloom_filter {
+  static const unsigned int block_words = 8;
+
+  std::vector<uint64_t> words_;
+  const uint64_t        nb_blocks_;
+  const unsigned int    nb_hashes_;
+
+  static unsigned int optimal_hashes(double fpr) {
+    return std::max(1, std::min(16, (int)std::lround(-std::log2(fpr))));
+  }
+
+  // Word and bit of the i-th hash of a k-mer hash h in its block
+  static unsigned int bit(uint64_t h2, unsigned int i) { return (h2 >> (9 * (i % 7))) & 0x1ff; }
+
+  static uint64_t read_word(std::istream& is) {
+    uint64_t w = 0;
+    is.read((char*)&w, sizeof(w));
+    if(!is.good())
+      throw std::runtime_error("Truncated Bloom filter");
+    return w;
+  }
+
+public:
+  // Filter for nb_elements elements with a false positive rate of
+  // about fpr
+  bloom_filter(size_t nb_elements, double fpr) :
+    words_(block_words * std::max((size_t)1, (size_t)(-(double)nb_elements * std::log(fpr) / (M_LN2 * M_LN2) / 512) + 1), 0),
+    nb_blocks_(words_.size() / block_words),
+    nb_hashes_(optimal_hashes(fpr))
+  { }
+
+  // Read a filter written by write()
+  explicit bloom_filter(std::istream& is) :
+    words_(block_words * read_word(is)),
+    nb_blocks_(words_.size() / block_words),
+    nb_hashes_(read_word(is))
+  {
+    is.read((char*)words_.data(), words_.size() * sizeof(uint64_t));
+    if(is.fail())
+      throw std::runtime_error("Truncated Bloom filter");
+  }
+
+  void write(std::ostream& os) const {
+    const uint64_t sizes[2] = { nb_blocks_, nb_hashes_ };
+    os.write((const char*)sizes, sizeof(sizes));
+    os.write((const char*)words_.data(), words_.size() * sizeof(uint64_t));
+  }
+
+  size_t memory_usage() const { return words_.size() * sizeof(uint64_t); }
+
+  static uint64_t hash(const jellyfish::mer_dna& m) { return mer_hash(m); }
+
+  // Insert the k-mer with hash h. Return true if it was already present
+  bool insert_hash(uint64_t h) {
+    uint64_t* const block   = &words_[block_words * (h % nb_blocks_)];
+    uint64_t        h2      = mix_bits(h);
+    bool            present = true;
+    for(unsigned int i = 0; i < nb_hashes_; ++i) {
+      if(i && i % 7 == 0)
+        h2 = mix_bits(h2);
+      const unsigned int b    = bit(h2, i);
+      const uint64_t     mask = (uint64_t)1 << (b % 64);
+      uint64_t&          w    = block[b / 64];
+      if(!(w & mask))
+        present = (__sync_fetch_and_or(&w, mask) & mask) && present;
+    }
+    return present;
+  }
+  bool insert(const jellyfish::mer_dna& m) { return insert_hash(hash(m)); }
+
+  bool contains_hash(uint64_t h) const {
+    const uint64_t* const block = &words_[block_words * (h % nb_blocks_)];
+    uint64_t              h2    = mix_bits(h);
+    for(unsigned int i = 0; i < nb_hashes_; ++i) {
+      if(i && i % 7 == 0)
+        h2 = mix_bits(h2);
+      const unsigned int b = bit(h2, i);
+      if(!(block[b / 64] & ((uint64_t)1 << (b % 64))))
+        return false;
+    }
+    return true;
+  }
+  bool contains(const jellyfish::mer_dna& m) const { return contains_hash(hash(m)); }
+
+  void prefetch_hash(uint64_t h) const { __builtin_prefetch(&words_[block_words * (h % nb_blocks_)]); }
+};
+
+#endif /* __QUORUM_BLOOM_FILTER_HPP__ */
@@ -0,0 +1,59 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+
+#include <src/mer_database.hpp>
+#include <src/mphf_database.hpp>
+#include <src/cuckoo_database.hpp>
+#include <src/verbose_log.hpp>
+#include <src/convert_database_cmdline.hpp>
+
+int main(int argc, char *argv[])
+{
+  convert_database_cmdline args(argc, argv);
+  verbose_log::verbose = args.verbose_flag;
+
+  if(args.layout_arg != "mphf" && args.layout_arg != "cuckoo")
+    convert_database_cmdline::error() << "Unknown layout '" << args.layout_arg << "'";
+  if(args.fingerprint_bits_arg < 1 || args.fingerprint_bits_arg > 64)
+    convert_database_cmdline::error() << "The fingerprint length must be between 1 and 64";
+  if(args.gamma_arg < 1.0)
+    convert_database_cmdline::error() << "Gamma must be at least 1";
+
+  // The layouts of the database need k
+  mer_dna::k(parse_database_header(args.db_arg).key_len() / 2);
+  const database_query input(args.db_arg, load_options(false, args.threads_arg));
+
+  std::ofstream output(args.output_arg);
+  if(!output.good())
+    convert_database_cmdline::error() << "Failed to open output file '" << args.output_arg << "'";
+  database_header header;
+  header.fill_standard();
+  header.set_cmdline(argc, argv);
+  if(args.layout_arg == "mphf")
+    write_mphf_database(input.backend(), input.header().key_len(), input.header().bits(),
+                        output, header, args.fingerprint_bits_arg, args.gamma_arg);
+  else
+    write_cuckoo_database(input.backend(), input.header().key_len(), input.header().bits(), output, header);
+  output.close();
+  if(!output.good())
+    convert_database_cmdline::error() << "Error while writing database '" << args.output_arg << "'";
+  vlog << "Wrote " << header.nb_keys() << " k-mers in the " << header.layout() << " layout";
+
+  return 0;
+}
@@ -16,9 +16,17 @@
  */
 
 #include <iostream>
+#include <fstream>
 #include <string>
+#include <cstring>
+#include <cerrno>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <numeric>
+#include <memory>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <jellyfish/mer_dna.hpp>
 #include <jellyfish/file_header.hpp>
@@ -27,8 +35,17 @@
 #include <jellyfish/stream_manager.hpp>
 #include <jellyfish/whole_sequence_parser.hpp>
 #include <jellyfish/large_hash_array.hpp>
+#include <jellyfish/locks_pthread.hpp>
 
 #include <src/mer_database.hpp>
+#include <src/fixed_mer.hpp>
+#include <src/hyperloglog.hpp>
+#include <src/minimizer.hpp>
+#include <src/supermer_spiller.hpp>
+#include <src/read_encoder.hpp>
+#include <src/bloom_filter.hpp>
+#include <src/sketch_database.hpp>
+#include <src/verbose_log.hpp>
 #include <src/create_database_cmdline.hpp>
 
 namespace err = jellyfish::err;
@@ -41,60 +58,374 @@ typedef std::vector<const char*> file_vector;
 typedef jellyfish::stream_manager<file_vector::const_iterator> stream_manager;
 typedef jellyfish::whole_sequence_parser<stream_manager> read_parser;
 
+// Count the k-mers of the reads in the hash. If a filter is given, a
+// low quality k-mer is added to the hash only from its second sighting
+// on (see hash_with_quality::prefiltered()). If a sketch is given, the
+// k-mers are counted in the sketch, and in the hash only once their
+// count saturates the sketch. As the sketch can not be enumerated,
+// the number of distinct high quality k-mers (estimated with a
+// HyperLogLog sketch per thread) and their total count are then kept
+// for the header.
 class quality_mer_counter : public jellyfish::thread_exec {
-  hash_with_quality& ary_;
-  read_parser        parser_;
-  const char         qual_thresh_;
+  hash_with_quality&       ary_;
+  read_parser              parser_;
+  const char               qual_thresh_;
+  bloom_filter*            filter_;
+  count_min_sketch*        sketch_;
+  std::vector<hyperloglog> high_mers_;
+  std::vector<uint64_t>    high_totals_;
 
 public:
-  quality_mer_counter(int nb_threads, hash_with_quality& ary, stream_manager& streams, char qual_thresh) :
+  quality_mer_counter(int nb_threads, hash_with_quality& ary, stream_manager& streams, char qual_thresh,
+                      bloom_filter* filter = 0, count_min_sketch* sketch = 0) :
     ary_(ary),
     parser_(4 * nb_threads, 100, 1, streams),
-    qual_thresh_(qual_thresh)
-  { }
+    qual_thresh_(qual_thresh),
+    filter_(filter),
+    sketch_(sketch),
+    high_mers_(sketch ? nb_threads : 0),
+    high_totals_(sketch ? nb_threads : 0, 0)
+  {
+    ary_.prefiltered(filter_ != 0);
+  }
 
   virtual void start(int thid) {
-    mer_dna m, rm;
-    size_t counted_high = 0, counted_low = 0;
+    switch(fixed_mer_words(mer_dna::k())) {
+    case 1: count<fixed_mer<1> >(thid); break;
+    case 2: count<fixed_mer<2> >(thid); break;
+    default: count<mer_dna>(thid); break;
+    }
+    if(!ary_.done())
+      throw std::runtime_error(err::msg() << "Hash is full");
+  }
+
+  // Only with a sketch
+  uint64_t distinct_high() const {
+    hyperloglog res(high_mers_.front());
+    for(auto it = high_mers_.cbegin() + 1; it < high_mers_.cend(); ++it)
+      res.merge(*it);
+    return res.estimate();
+  }
+  uint64_t total_high() const {
+    return std::accumulate(high_totals_.cbegin(), high_totals_.cend(), (uint64_t)0);
+  }
+
+private:
+  // Count with mers of type mer_t, copied into a mer_dna to be added
+  // to the hash.
+  template<typename mer_t>
+  void count(int thid) {
+    mer_t                   m, rm;
+    mer_dna                 tmp;
+    size_t                  counted_high = 0, counted_low = 0;
+    hash_with_quality_cache cache(ary_);
+    std::vector<uint8_t>    codes;
 
     while(true) {
       read_parser::job job(parser_);
       if(job.is_empty()) break;
 
       for(size_t i = 0; i < job->nb_filled; ++i) { // Process each read
-        std::string& seq = job->data[i].seq;
-        std::string& quals = job->data[i].qual;
+        const std::string& seq   = job->data[i].seq;
+        std::string&       quals = job->data[i].qual;
+        if(quals.size() < seq.size())
+          quals.resize(seq.size(), '\0');
+        codes.resize(seq.size());
+        read_encoding::encode(seq.data(), quals.data(), seq.size(), qual_thresh_, codes.data());
 
-        auto         base     = seq.begin();
-        auto         qual     = quals.begin();
         unsigned int low_len  = 0; // Length of low quality stretch
         unsigned int high_len = 0; // Length of high quality stretch
-        for( ; base != seq.end(); ++base, ++qual) {
-          int code = mer_dna::code(*base);
-          if(mer_dna::not_dna(code)) {
+        for(auto it = codes.cbegin(); it != codes.cend(); ++it) {
+          const uint8_t c = *it;
+          if(c & read_encoding::not_dna) {
             high_len = low_len = 0;
             continue;
           }
+          const int code = c & read_encoding::code_mask;
           m.shift_left(code);
           rm.shift_right(mer_dna::complement(code));
           ++low_len;
-          if(*qual >= qual_thresh_)
+          if(c & read_encoding::high)
             ++high_len;
           else
             high_len = 0;
           if(low_len >= mer_dna::k()) {
-            if(!ary_.add(m < rm ? m : rm, high_len >= mer_dna::k()))
+            const bool     high = high_len >= mer_dna::k();
+            const mer_dna& cm   = to_mer_dna(m < rm ? m : rm, tmp);
+            if(!high && filter_ && !filter_->insert(cm))
+              continue; // First sighting, only in the filter
+            if(!(sketch_ && sketch_->add(cm, high)) && !cache.add(cm, high))
               throw std::runtime_error(err::msg() << "Hash is full");
-            counted_high += high_len >= mer_dna::k();
+            counted_high += high;
             ++counted_low;
+            if(high && sketch_)
+              high_mers_[thid].add(cm);
+          }
+        }
+      }
+    }
+    if(!cache.flush())
+      throw std::runtime_error(err::msg() << "Hash is full");
+    if(sketch_)
+      high_totals_[thid] = counted_high;
+  }
+};
+
+// Estimate the number of distinct canonical k-mers in the reads, and
+// in the database db if given. Each thread updates its own
+// HyperLogLog sketch, merged in estimate().
+class distinct_mer_estimator : public jellyfish::thread_exec {
+  read_parser              parser_;
+  std::vector<hyperloglog> sketches_;
+  const database_backend*  db_;
+
+public:
+  distinct_mer_estimator(int nb_threads, stream_manager& streams, const database_backend* db = 0) :
+    parser_(4 * nb_threads, 100, 1, streams),
+    sketches_(nb_threads),
+    db_(db)
+  { }
+
+  virtual void start(int thid) {
+    mer_dna      m, rm;
+    hyperloglog& sketch = sketches_[thid];
+
+    while(true) {
+      read_parser::job job(parser_);
+      if(job.is_empty()) break;
+
+      for(size_t i = 0; i < job->nb_filled; ++i) { // Process each read
+        const std::string& seq = job->data[i].seq;
+        unsigned int       len = 0;
+        for(auto base = seq.cbegin(); base != seq.cend(); ++base) {
+          int code = mer_dna::code(*base);
+          if(mer_dna::not_dna(code)) {
+            len = 0;
+            continue;
           }
+          m.shift_left(code);
+          rm.shift_right(mer_dna::complement(code));
+          if(++len >= mer_dna::k())
+            sketch.add(m < rm ? m : rm);
         }
       }
     }
-    ary_.done();
+
+    if(db_) {
+      std::unique_ptr<database_backend::cursor> c(db_->new_slice_cursor(thid, sketches_.size()));
+      while(c->next())
+        sketch.add(c->key());
+    }
   }
+
+  double estimate() const {
+    hyperloglog res(sketches_.front());
+    for(auto it = sketches_.cbegin() + 1; it < sketches_.cend(); ++it)
+      res.merge(*it);
+    return res.estimate();
+  }
+
+  double error() const { return sketches_.front().error(); }
 };
 
+// Load factor targeted when the size is estimated from the reads, and
+// when compacting
+static const double estimated_load_factor = 0.8;
+// Initial size of the hash, relative to the estimated size, when the
+// singletons are filtered out
+static const double prefiltered_size_fraction = 0.25;
+
+// Hash size of a partition with -s, relative to an even share of the
+// given size: the minimizers do not split the k-mers evenly
+static const double partition_size_slack = 1.5;
+
+// Initial size of the hash of the heavy hitters with --sketch
+static const size_t heavy_hitters_size = 1 << 16;
+
+// Hash size for an estimated number of distinct k-mers. Add 3
+// standard errors to the estimate to be safe.
+static size_t estimated_size(double distinct, double error) {
+  return std::max((size_t)1, (size_t)(distinct * (1 + 3 * error) / estimated_load_factor));
+}
+
+static void open_output(std::ofstream& output, const char* path) {
+  output.open(path);
+  if(!output.good())
+    error() << "Failed to open output file '" << path << "'.";
+}
+
+// Count the k-mers of files in a hash of the given size and write it
+// to path in the layout selected on the command line. header is
+// updated with the description of the database. If existing is
+// given, its content is added to the hash first, and it is freed
+// before counting.
+static void build_database(const file_vector& files, size_t size, char qual_thresh,
+                           database_header& header, const char* path,
+                           std::unique_ptr<database_query> existing = std::unique_ptr<database_query>()) {
+  // When updating a database, it may be the output: leave it
+  // untouched until the new one is written.
+  std::ofstream output;
+  if(!args.in_place_flag && !existing)
+    open_output(output, path);
+
+  // With the filter, the singletons are not in the hash. The filter
+  // has room for all the k-mers, the hash starts smaller and grows if
+  // needed.
+  std::unique_ptr<bloom_filter> filter;
+  if(args.bloom_flag) {
+    filter.reset(new bloom_filter(size * estimated_load_factor, args.bloom_fpr_arg));
+    if(!args.size_given)
+      size = std::max((size_t)1, (size_t)(size * prefiltered_size_fraction));
+    vlog << "Bloom filter memory usage:" << (filter->memory_usage() >> 20) << "MB";
+  }
+  // With the sketch, the hash only has the heavy hitters: it starts
+  // small and grows if needed.
+  std::unique_ptr<count_min_sketch> sketch;
+  if(args.sketch_flag) {
+    sketch.reset(new count_min_sketch(args.sketch_size_given ? args.sketch_size_arg : size));
+    size = std::min(size, heavy_hitters_size);
+    vlog << "Sketch memory usage:" << (sketch->memory_usage() >> 20) << "MB";
+  }
+  // The filter and hot table files are named in the header, which is
+  // written before the data with --in-place. With partitions, each
+  // shard has its share of the hot k-mers.
+  const char* const  slash    = strrchr(path, '/');
+  const std::string  name     = slash ? slash + 1 : path;
+  const size_t       hot_mers = args.hot_mers_arg / std::max((uint32_t)1, args.partitions_arg);
+  if(args.lookup_filter_flag)
+    header.filter(name + ".filter");
+  if(hot_mers > 0)
+    header.hot(name + ".hot");
+
+  // With a memory bound, the hash and the table it is migrated into
+  // when full must fit.
+  const int hash_bits = args.inline_bits_arg ? args.inline_bits_arg : args.bits_arg;
+  if(args.max_memory_given) {
+    while(size > 1 && 2 * hash_with_quality::memory_usage(size, 2 * mer_dna::k(), hash_bits, args.reprobe_arg)
+          > args.max_memory_arg)
+      size /= 2;
+  }
+  vlog << "Expected memory usage:"
+       << (hash_with_quality::memory_usage(size, 2 * mer_dna::k(), hash_bits, args.reprobe_arg) >> 20) << "MB";
+
+  // The hash is freed before building the lookup filter
+  {
+    // The threads loading the existing database and the counting
+    // threads are different threads adding to the hash
+    hash_with_quality ary(size, 2 * mer_dna::k(), args.bits_arg,
+                          (existing ? 2 : 1) * args.threads_arg, args.reprobe_arg,
+                          args.in_place_flag ? path : 0, header, args.inline_bits_arg);
+    if(args.max_memory_given)
+      ary.max_memory(args.max_memory_arg);
+    if(existing) {
+      const std::vector<const database_backend*> dbs(1, &existing->backend());
+      database_merger                            merger(dbs, ary, args.threads_arg);
+      merger.exec_join(args.threads_arg);
+      if(merger.full())
+        error() << "Hash is full";
+      existing.reset();
+      vlog << "Loaded database '" << args.update_arg << "'";
+    }
+    {
+      stream_manager streams(files.cbegin(), files.cend(), 1);
+      quality_mer_counter counter(args.threads_arg, ary, streams, qual_thresh, filter.get(), sketch.get());
+      counter.exec_join(args.threads_arg);
+      if(sketch) {
+        header.distinct_high(counter.distinct_high());
+        header.total_high(counter.total_high());
+      }
+    }
+    filter.reset();
+    if(args.max_memory_given)
+      vlog << "Evicted k-mers:" << ary.evicted();
+
+    if(args.compact_given || args.prune_low_arg > 0 || args.prune_high_arg > 0) {
+      const uint64_t min_count[2] = { args.prune_low_arg, args.prune_high_arg };
+      ary.compact(min_count, args.compact_given ? args.compact_arg : estimated_load_factor, args.threads_arg);
+    }
+
+    if(args.in_place_flag) {
+      ary.write_in_place(&header);
+    } else {
+      if(!output.is_open())
+        open_output(output, path);
+      if(args.sketch_flag)
+        ary.write_sketch(output, *sketch, &header);
+      else if(args.packed_flag)
+        ary.write_packed(output, &header, args.threads_arg);
+      else if(args.neighbor_flag)
+        ary.write_neighbor(output, &header, args.threads_arg);
+      else
+        ary.write(output, &header);
+      output.close();
+      if(output.fail())
+        error() << "Failed to write output file '" << path << "'.";
+    }
+  }
+
+  if(args.lookup_filter_flag)
+    write_lookup_filter(path, args.lookup_filter_fpr_arg);
+  if(hot_mers > 0)
+    write_hot_table(path, hot_mers);
+}
+
+// Out of core construction. The reads are split by minimizer into
+// partitions stored in temporary files next to the output. Then each
+// partition is counted on its own and written as a shard of the
+// database. The output file is an index of the shards. Only the hash
+// of one partition is in memory at any time.
+static void build_partitioned_database(char qual_thresh, const database_header& header) {
+  const size_t             nb_parts = args.partitions_arg;
+  const minimizer          min(std::min(args.minimizer_len_arg, mer_dna::k()));
+  const std::string        output(args.output_arg);
+  const size_t             slash = output.find_last_of('/');
+  const std::string        output_name = slash == std::string::npos ? output : output.substr(slash + 1);
+  std::vector<std::string> parts;
+  for(size_t p = 0; p < nb_parts; ++p) {
+    std::ostringstream path;
+    path << output << ".part" << p << ".fastq";
+    parts.push_back(path.str());
+  }
+
+  vlog << "Partitioning reads into " << nb_parts << " files";
+  stream_manager   streams(args.reads_arg.cbegin(), args.reads_arg.cend(), 1);
+  supermer_spiller spiller(args.threads_arg, streams, min, parts);
+  spiller.exec_join(args.threads_arg);
+  spiller.close();
+
+  database_header index(header);
+  for(size_t p = 0; p < nb_parts; ++p) {
+    std::ostringstream suffix;
+    suffix << "." << p;
+    const size_t size = args.size_given ?
+      (size_t)(partition_size_slack * ((args.size_arg + nb_parts - 1) / nb_parts)) :
+      estimated_size(spiller.estimate(p), spiller.error());
+    vlog << "Counting partition " << p << " hash size:" << size;
+    database_header  shard_header(header);
+    const file_vector files(1, parts[p].c_str());
+    build_database(files, size, qual_thresh, shard_header, (output + suffix.str()).c_str());
+    unlink(parts[p].c_str());
+    if(p == 0) {
+      index.matrix(shard_header.matrix());
+      index.size(shard_header.size());
+    }
+    if(args.sketch_flag) { // The partitions have distinct k-mers
+      index.distinct_high(index.distinct_high() + shard_header.distinct_high());
+      index.total_high(index.total_high() + shard_header.total_high());
+    }
+    index.add_shard(output_name + suffix.str());
+  }
+
+  std::ofstream index_output(args.output_arg);
+  if(!index_output.good())
+    error() << "Failed to open output file '" << args.output_arg << "'.";
+  index.set_format();
+  index.layout("sharded");
+  index.minimizer_len(min.m());
+  index.bits(args.bits_arg);
+  index.write(index_output);
+}
+
 int main(int argc, char *argv[])
 {
   database_header header;
@@ -110,20 +441,56 @@ int main(int argc, char *argv[])
   char qual_thresh = args.min_qual_char_given ? args.min_qual_char_arg[0] : (char)args.min_qual_value_arg;
   if(args.bits_arg < 1 || args.bits_arg > 63)
     error("The number of bits should be between 1 and 63");
-  std::ofstream output(args.output_arg);
-  if(!output.good())
-    error() << "Failed to open output file '" << args.output_arg << "'.";
+  if(args.inline_bits_arg >= args.bits_arg)
+    error("The number of inline bits should be less than the number of bits");
+  if(args.neighbor_flag && !hash_with_quality::neighbor_layout_fits(args.bits_arg))
+    error("The number of bits should be at most 14 with --neighbor");
+  if(args.compact_given && (args.compact_arg <= 0 || args.compact_arg > 1))
+    error("The load factor of --compact should be in (0, 1]");
+  if(args.minimizer_len_arg < 1 || args.minimizer_len_arg > 32)
+    error("The minimizer length should be between 1 and 32");
+  verbose_log::verbose = args.verbose_flag;
 
-  hash_with_quality ary(args.size_arg, 2 * mer_dna::k(), args.bits_arg,
-                        args.threads_arg, args.reprobe_arg);
-  {
-    stream_manager streams(args.reads_arg.cbegin(), args.reads_arg.cend(), 1);
-    quality_mer_counter counter(args.threads_arg, ary, streams, qual_thresh);
-    counter.exec_join(args.threads_arg);
+  if(args.partitions_arg > 0) {
+    build_partitioned_database(qual_thresh, header);
+    return 0;
+  }
+
+  // The database to update is read in memory, as it may be
+  // overwritten by the output
+  std::unique_ptr<database_query> existing;
+  if(args.update_given) {
+    const database_header update_header(parse_database_header(args.update_arg));
+    if(update_header.key_len() != 2 * mer_dna::k())
+      error() << "The k-mers of '" << args.update_arg << "' have length " << (update_header.key_len() / 2)
+              << " instead of " << mer_dna::k();
+    if(update_header.layout() == "mphf" || update_header.layout() == "sketch")
+      error() << "The " << update_header.layout() << " layout of '" << args.update_arg
+              << "' does not store the k-mers";
+    existing.reset(new database_query(args.update_arg, load_options(true, args.threads_arg)));
   }
 
-  ary.write(output, &header);
-  output.close();
+  size_t size = args.size_arg;
+  if(!args.size_given) {
+    // Extra pass over the reads to avoid resizing the hash while
+    // counting. A pipe would be empty for the counting pass.
+    for(auto it = args.reads_arg.cbegin(); it != args.reads_arg.cend(); ++it) {
+      struct stat st;
+      if(stat(*it, &st) < 0)
+        error() << "Can't stat read file '" << *it << "': " << strerror(errno);
+      if(!S_ISREG(st.st_mode))
+        error() << "Read file '" << *it << "' is not a regular file and can't be read twice to estimate the hash size. "
+                << "Give the size with -s.";
+    }
+    vlog << "Estimating number of distinct k-mers";
+    stream_manager         streams(args.reads_arg.cbegin(), args.reads_arg.cend(), 1);
+    distinct_mer_estimator estimator(args.threads_arg, streams, existing ? &existing->backend() : 0);
+    estimator.exec_join(args.threads_arg);
+    const double distinct = estimator.estimate();
+    size = estimated_size(distinct, estimator.error());
+    vlog << "Estimated distinct k-mers:" << (uint64_t)distinct << " hash size:" << size;
+  }
+  build_database(args.reads_arg, size, qual_thresh, header, args.output_arg, std::move(existing));
 
   return 0;
 }
@@ -0,0 +1,321 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_CUCKOO_DATABASE_HPP__
+#define __QUORUM_CUCKOO_DATABASE_HPP__
+
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <src/database_backend.hpp>
+#include <src/hyperloglog.hpp>
+#include <src/read_encoder.hpp> // For the AVX2 detection
+#include <src/verbose_log.hpp>
+
+// Geometry of the buckets of the cuckoo layout. A bucket is a 64 byte
+// cache line (or more for very long k-mers): the words of the keys of
+// its slots, then the values of its slots, then some padding. With k
+// <= 32, a bucket has 4 slots: the 4 keys are compared with one AVX2
+// instruction.
+struct cuckoo_geometry {
+  const unsigned int nb_words;     // Words of a key
+  const unsigned int slots;        // Slots in a bucket
+  const unsigned int bucket_words; // Words of a bucket, with padding
+
+  explicit cuckoo_geometry(unsigned int w) :
+    nb_words(w),
+    slots(std::max(1u, 8 / (w + 1))),
+    bucket_words((slots * (w + 1) + 7) / 8 * 8)
+  { }
+
+  // The two buckets of a k-mer of hash h, different if possible
+  static void buckets(uint64_t h, uint64_t nb_buckets, uint64_t& b1, uint64_t& b2) {
+    b1 = h % nb_buckets;
+    b2 = mix_bits(h) % nb_buckets;
+    if(b2 == b1 && nb_buckets > 1)
+      b2 = (b1 + 1) % nb_buckets;
+  }
+};
+
+// Read-only layout "cuckoo": a bucketized cuckoo hash table. A k-mer
+// is in one of its two buckets, so a lookup reads at most two cache
+// lines, whatever the load factor. The jellyfish table has unbounded
+// (up to max_reprobe) probe sequences instead.
+//
+// Data: the number of buckets as a 64 bit word, padding to a multiple
+// of 64 bytes in the file, then the buckets. An empty slot has a
+// value of 0.
+class cuckoo_database : public database_backend {
+  const cuckoo_geometry geo_;
+  uint64_t              nb_buckets_;
+  const uint64_t*       buckets_;
+  const bool            avx2_;
+
+  class key_cursor : public cursor {
+    const cuckoo_database& db_;
+    uint64_t               bucket_;
+    unsigned int           slot_;
+    mer_dna                mer_;
+    uint64_t               val_;
+  public:
+    key_cursor(const cuckoo_database& db) : db_(db), bucket_(0), slot_(0), val_(0) { }
+    virtual bool next() {
+      for( ; bucket_ < db_.nb_buckets_; ++bucket_, slot_ = 0) {
+        const uint64_t* const b = db_.bucket(bucket_);
+        for( ; slot_ < db_.geo_.slots; ++slot_) {
+          val_ = b[db_.geo_.slots * db_.geo_.nb_words + slot_];
+          if(val_ == 0)
+            continue;
+          for(unsigned int i = 0; i < db_.geo_.nb_words; ++i)
+            mer_.word__(i) = b[slot_ * db_.geo_.nb_words + i];
+          ++slot_;
+          return true;
+        }
+      }
+      return false;
+    }
+    virtual const mer_dna& key() const { return mer_; }
+    virtual value_type val() const { return decode(val_); }
+  };
+
+  const uint64_t* bucket(uint64_t i) const { return buckets_ + i * geo_.bucket_words; }
+
+  // Mask of the slots of the 4 keys equal to key
+  static unsigned int match4(const uint64_t* keys, uint64_t key) {
+    unsigned int res = 0;
+    for(unsigned int i = 0; i < 4; ++i)
+      res |= (unsigned int)(keys[i] == key) << i;
+    return res;
+  }
+#ifdef QUORUM_HAVE_AVX2_TARGET
+  __attribute__((target("avx2")))
+  static unsigned int match4_avx2(const uint64_t* keys, uint64_t key) {
+    const __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)keys), _mm256_set1_epi64x(key));
+    return _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+  }
+#endif
+
+  // Value of m in bucket b, 0 if absent
+  uint64_t find(const uint64_t* b, const mer_dna& m) const {
+    const uint64_t* const vals = b + geo_.slots * geo_.nb_words;
+    if(geo_.nb_words == 1 && geo_.slots == 4) {
+      unsigned int mask;
+#ifdef QUORUM_HAVE_AVX2_TARGET
+      mask = avx2_ ? match4_avx2(b, m.word(0)) : match4(b, m.word(0));
+#else
+      mask = match4(b, m.word(0));
+#endif
+      // An empty slot may have a key equal to m (e.g. poly-A)
+      for( ; mask; mask &= mask - 1) {
+        const uint64_t v = vals[__builtin_ctz(mask)];
+        if(v)
+          return v;
+      }
+      return 0;
+    }
+    for(unsigned int s = 0; s < geo_.slots; ++s) {
+      if(!vals[s])
+        continue;
+      unsigned int i = 0;
+      while(i < geo_.nb_words && b[s * geo_.nb_words + i] == m.word(i))
+        ++i;
+      if(i == geo_.nb_words)
+        return vals[s];
+    }
+    return 0;
+  }
+
+  value_type get_hash(const mer_dna& m, uint64_t h) const {
+    uint64_t b1, b2;
+    cuckoo_geometry::buckets(h, nb_buckets_, b1, b2);
+    uint64_t v = find(bucket(b1), m);
+    if(!v)
+      v = find(bucket(b2), m);
+    return decode(v);
+  }
+
+public:
+  cuckoo_database(const database_header& header, char* base) :
+    database_backend(header),
+    geo_(header.key_words()),
+#ifdef QUORUM_HAVE_AVX2_TARGET
+    avx2_(read_encoding::have_avx2())
+#else
+    avx2_(false)
+#endif
+  {
+    const char* data = base + header.offset();
+    memcpy(&nb_buckets_, data, sizeof(nb_buckets_));
+    const size_t start = header.offset() + sizeof(uint64_t);
+    buckets_           = (const uint64_t*)(base + (start + 63) / 64 * 64);
+  }
+
+  virtual value_type get(const mer_dna& m) const { return get_hash(m, mer_hash(m)); }
+
+  // The hash positions are those of the original database: ignore
+  // them and prefetch the two buckets of every mer instead.
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    uint64_t hashes[max_batch * 4];
+    for(size_t start = 0; start < n; start += max_batch * 4) {
+      const size_t len = std::min(n - start, max_batch * 4);
+      for(size_t i = 0; i < len; ++i) {
+        uint64_t b1, b2;
+        hashes[i] = mer_hash(mers[start + i]);
+        cuckoo_geometry::buckets(hashes[i], nb_buckets_, b1, b2);
+        __builtin_prefetch(bucket(b1));
+        __builtin_prefetch(bucket(b2));
+      }
+      for(size_t i = 0; i < len; ++i)
+        vals[start + i] = get_hash(mers[start + i], hashes[i]);
+    }
+  }
+
+  virtual cursor* new_cursor(bool with_keys) const { return new key_cursor(*this); }
+};
+
+// Builder of the cuckoo table, by random walk insertion.
+class cuckoo_builder {
+  const cuckoo_geometry geo_;
+  const uint64_t        nb_buckets_;
+  std::vector<uint64_t> buckets_;
+  uint64_t              rand_;
+  std::vector<uint64_t> key_, tmp_;
+
+  static const unsigned int max_kicks = 1000;
+
+  uint64_t* bucket(uint64_t i) { return &buckets_[i * geo_.bucket_words]; }
+  uint64_t& val(uint64_t* b, unsigned int s) { return b[geo_.slots * geo_.nb_words + s]; }
+  uint64_t* key(uint64_t* b, unsigned int s) { return b + s * geo_.nb_words; }
+
+  uint64_t next_rand() {
+    rand_ ^= rand_ << 13;
+    rand_ ^= rand_ >> 7;
+    rand_ ^= rand_ << 17;
+    return rand_;
+  }
+
+  uint64_t hash(const uint64_t* k) const {
+    uint64_t h = 0;
+    for(unsigned int i = 0; i < geo_.nb_words; ++i)
+      h = mix_bits(h ^ k[i]);
+    return h;
+  }
+
+  bool place(uint64_t bi, const uint64_t* k, uint64_t v) {
+    uint64_t* const b = bucket(bi);
+    for(unsigned int s = 0; s < geo_.slots; ++s) {
+      if(val(b, s) == 0) {
+        std::copy(k, k + geo_.nb_words, key(b, s));
+        val(b, s) = v;
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  cuckoo_builder(uint64_t nb_buckets) :
+    geo_(mer_dna::nb_words()), nb_buckets_(nb_buckets),
+    buckets_(nb_buckets * geo_.bucket_words, 0), rand_(0x2545f4914f6cdd1dULL),
+    key_(geo_.nb_words), tmp_(geo_.nb_words)
+  { }
+
+  // Target load factor of the table
+  static double load_factor(const cuckoo_geometry& geo) {
+    return geo.slots >= 4 ? 0.9 : (geo.slots >= 2 ? 0.8 : 0.45);
+  }
+
+  uint64_t nb_buckets() const { return nb_buckets_; }
+  const std::vector<uint64_t>& buckets() const { return buckets_; }
+
+  // Insert m with the value v (not 0). Return false if it failed, in
+  // which case the table has lost a k-mer and must be rebuilt larger.
+  bool insert(const mer_dna& m, uint64_t v) {
+    for(unsigned int i = 0; i < geo_.nb_words; ++i)
+      key_[i] = m.word(i);
+    for(unsigned int kick = 0; kick < max_kicks; ++kick) {
+      uint64_t b1, b2;
+      cuckoo_geometry::buckets(hash(key_.data()), nb_buckets_, b1, b2);
+      if(place(b1, key_.data(), v) || place(b2, key_.data(), v))
+        return true;
+      // Evict a random entry of one of the two buckets
+      const uint64_t     r = next_rand();
+      uint64_t* const    b = bucket(r & 1 ? b1 : b2);
+      const unsigned int s = (r >> 1) % geo_.slots;
+      std::copy(key(b, s), key(b, s) + geo_.nb_words, tmp_.begin());
+      std::copy(key_.begin(), key_.end(), key(b, s));
+      std::swap(v, val(b, s));
+      key_.swap(tmp_);
+    }
+    return false;
+  }
+};
+
+// Write the content of db, with keys of key_len bits and values of
+// bits bits, in the cuckoo layout. header is filled and written
+// before the data.
+inline void write_cuckoo_database(const database_backend& db, unsigned int key_len, unsigned int bits,
+                                  std::ostream& os, database_header& header) {
+  const cuckoo_geometry geo(mer_dna::nb_words());
+  size_t                nb_mers = 0;
+  {
+    std::unique_ptr<database_backend::cursor> c(db.new_cursor(false));
+    while(c->next())
+      ++nb_mers;
+  }
+
+  uint64_t nb_buckets = std::max((uint64_t)1, (uint64_t)(nb_mers / (geo.slots * cuckoo_builder::load_factor(geo))) + 1);
+  std::unique_ptr<cuckoo_builder> table;
+  while(true) {
+    table.reset(new cuckoo_builder(nb_buckets));
+    std::unique_ptr<database_backend::cursor> c(db.new_cursor(true));
+    bool                                      success = true;
+    while(success && c->next()) {
+      const database_backend::value_type v = c->val();
+      success = table->insert(c->key(), (v.first << 1) | v.second);
+    }
+    if(success)
+      break;
+    nb_buckets += nb_buckets / 10 + 1;
+    vlog << "Cuckoo table full, retrying with " << nb_buckets << " buckets";
+  }
+  vlog << "Cuckoo table of " << nb_mers << " k-mers, load factor:"
+       << ((double)nb_mers / (nb_buckets * geo.slots));
+
+  header.set_format();
+  header.layout("cuckoo");
+  header.key_len(key_len);
+  header.bits(bits);
+  header.nb_keys(nb_mers);
+  header.matrix(db.matrix());
+  header.size(db.size_mask() + 1);
+  header.write(os);
+
+  // Align the buckets on cache lines
+  static const char zeros[64] = { 0 };
+  const uint64_t    start     = (uint64_t)os.tellp() + sizeof(nb_buckets);
+  os.write((const char*)&nb_buckets, sizeof(nb_buckets));
+  os.write(zeros, (64 - start % 64) % 64);
+  os.write((const char*)table->buckets().data(), table->buckets().size() * sizeof(uint64_t));
+}
+
+#endif /* __QUORUM_CUCKOO_DATABASE_HPP__ */
@@ -0,0 +1,523 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_DATABASE_BACKEND_HPP__
+#define __QUORUM_DATABASE_BACKEND_HPP__
+
+#include <utility>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <sstream>
+
+#include <src/database_header.hpp>
+#include <src/hot_table.hpp>
+
+// Hash positions of the four mers that differ from m only in base 0
+// (calc) or only in base k-1 (calc_last). The hash is linear over
+// GF(2): changing a base XORs the hash with the product of the matrix
+// and the change. So one matrix product, instead of four, gives the
+// four positions.
+class oid_speed_calc {
+  const RectangularBinaryMatrix matrix_;
+  const uint64_t                size_mask_;
+  const unsigned int            last_word_, last_shift_; // Location of base k-1
+  uint64_t                      first_[4]; // Hash of the mer with base 0 equal to b, others A
+  uint64_t                      last_[4];  // Same for base k-1
+
+  static uint64_t base_hash(const RectangularBinaryMatrix& matrix, unsigned int pos, uint64_t b) {
+    std::vector<uint64_t> v(matrix.c() / 64 + 2, 0);
+    v[2 * pos / 64] = b << (2 * pos % 64);
+    return matrix.times(v);
+  }
+
+public:
+  oid_speed_calc(const RectangularBinaryMatrix& matrix, uint64_t size_mask) :
+    matrix_(matrix), size_mask_(size_mask),
+    last_word_((matrix.c() - 2) / 64), last_shift_((matrix.c() - 2) % 64)
+  {
+    for(uint64_t b = 0; b < 4; ++b) {
+      first_[b] = base_hash(matrix, 0, b);
+      last_[b]  = base_hash(matrix, matrix.c() / 2 - 1, b);
+    }
+  }
+
+  void calc(const mer_dna& m, uint64_t oids[4]) const {
+    const uint64_t h = matrix_.times(m) ^ first_[m.word(0) & 0x3];
+    for(int b = 0; b < 4; ++b)
+      oids[b] = (h ^ first_[b]) & size_mask_;
+  }
+
+  void calc_last(const mer_dna& m, uint64_t oids[4]) const {
+    const uint64_t h = matrix_.times(m) ^ last_[(m.word(last_word_) >> last_shift_) & 0x3];
+    for(int b = 0; b < 4; ++b)
+      oids[b] = (h ^ last_[b]) & size_mask_;
+  }
+};
+
+// Read-only view of a mer database, one implementation per layout. A
+// value is a pair (count, quality). A k-mer absent from the database
+// has the value (0, 0).
+class database_backend {
+public:
+  typedef std::pair<uint64_t, int> value_type;
+
+  // Iterator over the entries of the database. key() is only valid if
+  // the cursor was created with keys.
+  class cursor {
+  public:
+    virtual ~cursor() { }
+    virtual bool next() = 0;
+    virtual const mer_dna& key() const = 0;
+    virtual value_type val() const = 0;
+  };
+  class empty_cursor : public cursor {
+  public:
+    virtual bool next() { return false; }
+    virtual const mer_dna& key() const { throw std::logic_error("Empty cursor"); }
+    virtual value_type val() const { return value_type(0, 0); }
+  };
+
+  // A batch of sibling groups: the four mers obtained by replacing
+  // base 0 of a mer by A, C, G and T. The backend decides what to
+  // store to look them up. By default, it is the canonical
+  // representation and the hash position of each of the four mers.
+  // Constructing a batch allocates its mers: reuse it with clear().
+  struct sibling_batch {
+    static const size_t max_groups = 4;
+    mer_dna mers[4 * max_groups];
+    size_t  oids[4 * max_groups];
+    int     field[max_groups];    // For use by the backend
+    bool    reversed[max_groups]; // For use by the caller
+    size_t  size;
+    mer_dna x, y;                 // Scratch space for the caller
+    mer_dna tmp;                  // Scratch space for the backend
+    sibling_batch() : size(0) { }
+    void clear() { size = 0; }
+  };
+
+protected:
+  const RectangularBinaryMatrix matrix_;
+  const size_t                  size_mask_;
+  const oid_speed_calc          speed_;
+
+public:
+  explicit database_backend(const database_header& header) :
+    matrix_(header.matrix()), size_mask_(header.size() - 1),
+    speed_(matrix_, size_mask_)
+  { }
+  virtual ~database_backend() { }
+  virtual value_type get(const mer_dna& m) const = 0;
+  virtual cursor* new_cursor(bool with_keys) const = 0;
+
+  // Cursor with keys over slice i of nb_slices: the slices partition
+  // the entries, to iterate with several threads. By default, slice 0
+  // has all the entries.
+  virtual cursor* new_slice_cursor(size_t i, size_t nb_slices) const {
+    return i == 0 ? new_cursor(true) : new empty_cursor;
+  }
+
+  // Look up mers[0..n), whose hash positions are oids[0..n), into
+  // vals[0..n). The implementations prefetch the hash slots of the
+  // whole batch before probing any of them, so that the cache misses
+  // overlap. n should not be much more than max_batch.
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    for(size_t i = 0; i < n; ++i)
+      vals[i] = get(mers[i]);
+  }
+  static const size_t max_batch = 16;
+
+  // Look up mers[0..n) into vals[0..n), max_batch at a time
+  void get_batch(const mer_dna* mers, value_type* vals, size_t n) const {
+    size_t oids[max_batch];
+    for(size_t start = 0; start < n; start += max_batch) {
+      const size_t len = std::min(n - start, max_batch);
+      for(size_t i = 0; i < len; ++i)
+        oids[i] = oid(mers[start + i]);
+      probe_batch(mers + start, oids, vals + start, len);
+    }
+  }
+
+  // Add the siblings of x to the batch, y being the reverse
+  // complement of x.
+  virtual void add_siblings(const mer_dna& x, const mer_dna& y, sibling_batch& batch) const {
+    mer_dna* const mers = batch.mers + 4 * batch.size;
+    size_t* const  oids = batch.oids + 4 * batch.size;
+    uint64_t       xoids[4], yoids[4];
+    // The sibling of x with base 0 equal to b is the mer y with base
+    // k-1 equal to the complement of b.
+    speed_.calc(x, xoids);
+    speed_.calc_last(y, yoids);
+    mer_dna&       rc   = batch.tmp;
+    for(int b = 0; b < 4; ++b) {
+      mers[b] = x;
+      mers[b].base(0) = b;
+      rc = y;
+      rc.base(mer_dna::k() - 1) = mer_dna::complement(b);
+      if(rc < mers[b]) {
+        mers[b] = rc;
+        oids[b] = yoids[mer_dna::complement(b)];
+      } else {
+        oids[b] = xoids[b];
+      }
+    }
+    ++batch.size;
+  }
+
+  // Look up the siblings in batch into vals[0..4*batch.size)
+  virtual void probe_siblings(const sibling_batch& batch, value_type* vals) const {
+    probe_batch(batch.mers, batch.oids, vals, 4 * batch.size);
+  }
+
+  // Hash position of a mer
+  size_t oid(const mer_dna& m) const { return matrix_.times(m) & size_mask_; }
+  const RectangularBinaryMatrix& matrix() const { return matrix_; }
+  size_t size_mask() const { return size_mask_; }
+
+  // Decode a value as stored by hash_with_quality: (count << 1 | quality)
+  static value_type decode(uint64_t v) { return value_type(v >> 1, v & 0x1); }
+};
+
+// Approximate address of the entry at position oid of an array of
+// size entries taking len bytes. Entries are packed in blocks of a few
+// words, so this is off by at most a block: good enough for a
+// prefetch. The ratio is kept in 1/64th of a byte to avoid overflowing
+// the product for large arrays.
+class slot_address {
+  const char* base_;
+  uint64_t    len_per_slot_; // 64 * len / size
+
+public:
+  slot_address(const char* base, uint64_t len, size_t size) :
+    base_(base), len_per_slot_((len << 6) / size) { }
+  const char* operator()(size_t oid) const { return base_ + ((oid * len_per_slot_) >> 6); }
+  void prefetch(size_t oid) const { __builtin_prefetch(operator()(oid)); }
+};
+
+// Keys in a large hash array with no value field, followed by the
+// values in a separate array. The values may have fewer bits than the
+// counts, the larger counts being in an overflow table (see
+// database_header::inline_bits()).
+class split_database : public database_backend {
+  const mer_array_raw        keys_;
+  const val_array_raw        vals_;
+  const slot_address         key_slots_;
+  const slot_address         val_slots_;
+  std::unique_ptr<hot_table> overflow_;
+  const uint64_t             escape_; // Count of the values in the overflow table
+
+  class key_cursor : public cursor {
+    const split_database&         db_;
+    mer_array_raw::const_iterator it_;
+    const mer_array_raw::const_iterator end_;
+    bool                          first_;
+  public:
+    explicit key_cursor(const split_database& db) :
+      db_(db), it_(db.keys_.begin()), end_(db.keys_.end()), first_(true) { }
+    virtual bool next() {
+      if(!first_ && it_ != end_)
+        ++it_;
+      first_ = false;
+      return it_ != end_;
+    }
+    virtual const mer_dna& key() const { return it_.key(); }
+    virtual value_type val() const { return db_.value(it_.key(), db_.vals_[it_.id()]); }
+  };
+
+  class slice_cursor : public cursor {
+    const split_database&         db_;
+    mer_array_raw::eager_iterator it_;
+  public:
+    slice_cursor(const split_database& db, size_t i, size_t nb_slices) :
+      db_(db), it_(db.keys_.eager_slice(i, nb_slices)) { }
+    virtual bool next() { return it_.next(); }
+    virtual const mer_dna& key() const { return it_.key(); }
+    virtual value_type val() const { return db_.value(it_.key(), db_.vals_[it_.id()]); }
+  };
+
+  class val_cursor : public cursor {
+    const val_array_raw& vals_;
+    const size_t         size_;
+    size_t               id_;
+    uint64_t             val_;
+  public:
+    val_cursor(const val_array_raw& vals, size_t size) : vals_(vals), size_(size), id_(0), val_(0) { }
+    virtual bool next() {
+      for( ; id_ < size_; ++id_) {
+        val_ = vals_[id_];
+        if(val_ >= 2) {
+          ++id_;
+          return true;
+        }
+      }
+      return false;
+    }
+    virtual const mer_dna& key() const { throw std::logic_error("Cursor created without keys"); }
+    virtual value_type val() const { return decode(val_); }
+  };
+
+  // Value of m, stored as v in the value array
+  value_type value(const mer_dna& m, uint64_t v) const {
+    return overflow_ && (v >> 1) == escape_ ? decode(overflow_->find(m)) : decode(v);
+  }
+
+  static unsigned int value_bits(const database_header& header) {
+    return header.overflow_bytes() ? header.inline_bits() : header.bits();
+  }
+
+public:
+  split_database(const database_header& header, char* base) :
+    database_backend(header),
+    keys_(base + header.offset(), header.key_bytes(),
+          header.size(), header.key_len(), header.val_len(),
+          header.max_reprobe(), header.matrix()),
+    vals_(base + header.offset() + header.key_bytes(), header.value_bytes(),
+          value_bits(header) + 1, header.size()),
+    key_slots_(base + header.offset(), header.key_bytes(), header.size()),
+    val_slots_(base + header.offset() + header.key_bytes(), header.value_bytes(), header.size()),
+    escape_(((uint64_t)1 << value_bits(header)) - 1)
+  {
+    if(header.overflow_bytes()) {
+      std::istringstream is(std::string(base + header.offset() + header.key_bytes() + header.value_bytes(),
+                                        header.overflow_bytes()));
+      overflow_.reset(new hot_table(is, header.key_words()));
+    }
+  }
+
+  virtual value_type get(const mer_dna& m) const {
+    size_t id = 0;
+    return keys_.get_key_id(m, &id) ? value(m, vals_[id]) : value_type(0, 0);
+  }
+
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    for(size_t i = 0; i < n; ++i) {
+      key_slots_.prefetch(oids[i]);
+      val_slots_.prefetch(oids[i]);
+    }
+    mer_dna                         tmp;
+    const mer_array_raw::data_word* w;
+    const mer_array_raw::offset_t*  o;
+    for(size_t i = 0; i < n; ++i) {
+      size_t id = 0;
+      vals[i] = keys_.get_key_id(mers[i], &id, tmp, &w, &o, oids[i])
+        ? value(mers[i], vals_[id]) : value_type(0, 0);
+    }
+  }
+
+  // The values in the overflow table are found by key
+  virtual cursor* new_cursor(bool with_keys) const {
+    if(with_keys || overflow_)
+      return new key_cursor(*this);
+    return new val_cursor(vals_, keys_.size());
+  }
+
+  virtual cursor* new_slice_cursor(size_t i, size_t nb_slices) const { return new slice_cursor(*this, i, nb_slices); }
+};
+
+// Keys and values in the same large hash array: the value field is
+// (count << 1 | quality), bits + 1 bits wide. A lookup touches only
+// one entry of the array instead of an entry in each of two arrays.
+class packed_database : public database_backend {
+  const mer_array_raw keys_;
+  const slot_address  key_slots_;
+
+  class key_cursor : public cursor {
+    mer_array_raw::const_iterator it_;
+    const mer_array_raw::const_iterator end_;
+    bool                          first_;
+  public:
+    explicit key_cursor(const mer_array_raw& keys) :
+      it_(keys.begin()), end_(keys.end()), first_(true) { }
+    virtual bool next() {
+      if(!first_ && it_ != end_)
+        ++it_;
+      first_ = false;
+      return it_ != end_;
+    }
+    virtual const mer_dna& key() const { return it_.key(); }
+    virtual value_type val() const { return decode(it_.val()); }
+  };
+
+  class slice_cursor : public cursor {
+    mer_array_raw::eager_iterator it_;
+  public:
+    slice_cursor(const mer_array_raw& keys, size_t i, size_t nb_slices) : it_(keys.eager_slice(i, nb_slices)) { }
+    virtual bool next() { return it_.next(); }
+    virtual const mer_dna& key() const { return it_.key(); }
+    virtual value_type val() const { return decode(it_.val()); }
+  };
+
+public:
+  packed_database(const database_header& header, char* base) :
+    database_backend(header),
+    keys_(base + header.offset(), header.key_bytes(),
+          header.size(), header.key_len(), header.val_len(),
+          header.max_reprobe(), header.matrix()),
+    key_slots_(base + header.offset(), header.key_bytes(), header.size())
+  { }
+
+  virtual value_type get(const mer_dna& m) const {
+    uint64_t v = 0;
+    return keys_.get_val_for_key(m, &v) ? decode(v) : value_type(0, 0);
+  }
+
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    for(size_t i = 0; i < n; ++i)
+      key_slots_.prefetch(oids[i]);
+    mer_dna tmp;
+    for(size_t i = 0; i < n; ++i) {
+      uint64_t v = 0;
+      vals[i] = keys_.get_val_for_key(mers[i], &v, tmp, oids[i])
+        ? decode(v) : value_type(0, 0);
+    }
+  }
+
+  virtual cursor* new_cursor(bool with_keys) const { return new key_cursor(keys_); }
+  virtual cursor* new_slice_cursor(size_t i, size_t nb_slices) const {
+    return new slice_cursor(keys_, i, nb_slices);
+  }
+};
+
+// Entries are the nodes of the de Bruijn graph of the database: the
+// (k-1)-mers. A node has up to four successors, the k-mers it is the
+// suffix of, and four predecessors. The value field of an entry holds
+// the values of the four successors or of the four predecessors, each
+// bits + 1 bits wide. The siblings of a mer, which share the
+// (k-1)-mer made of bases 1 to k-1, are all in the same entry, so a
+// sibling query is one probe of the array. Each k-mer is stored twice,
+// once in each of its nodes.
+//
+// The key of an entry is a k-mer: the canonical (k-1)-mer in bases 1
+// to k-1 and, in base 0, the side: 0 for the successors, 1 for the
+// predecessors.
+class neighbor_database : public database_backend {
+  const mer_array_raw keys_;
+  const slot_address  key_slots_;
+  const unsigned int  field_len_;
+  const uint64_t      field_mask_;
+
+  // Iterate over all the fields of all the entries. A k-mer is
+  // reported from the entry and field it is first stored at by
+  // neighbor_entry(), so once.
+  class key_cursor : public cursor {
+    mer_array_raw::const_iterator       it_;
+    const mer_array_raw::const_iterator end_;
+    const neighbor_database&            db_;
+    int                                 field_;
+    mer_dna                             mer_;
+    uint64_t                            val_;
+  public:
+    key_cursor(const neighbor_database& db) :
+      it_(db.keys_.begin()), end_(db.keys_.end()), db_(db), field_(0) { }
+    virtual bool next() {
+      mer_dna key, tmp;
+      while(it_ != end_) {
+        for( ; field_ < 4; ++field_) {
+          val_ = db_.field(it_.val(), field_);
+          if(val_ < 2) continue;
+          mer_ = it_.key();
+          if(mer_.base(0).code() == 0)
+            mer_.base(0) = field_;
+          else
+            mer_.shift_right(field_);
+          const mer_dna rc = mer_.get_reverse_complement();
+          if(rc < mer_) mer_ = rc;
+          const int f = neighbor_entry(mer_, mer_.get_reverse_complement(), key, tmp);
+          if(f == field_ && key == it_.key()) {
+            ++field_;
+            return true;
+          }
+        }
+        ++it_;
+        field_ = 0;
+      }
+      return false;
+    }
+    virtual const mer_dna& key() const { return mer_; }
+    virtual value_type val() const { return decode(val_); }
+  };
+
+public:
+  neighbor_database(const database_header& header, char* base) :
+    database_backend(header),
+    keys_(base + header.offset(), header.key_bytes(),
+          header.size(), header.key_len(), header.val_len(),
+          header.max_reprobe(), header.matrix()),
+    key_slots_(base + header.offset(), header.key_bytes(), header.size()),
+    field_len_(header.bits() + 1),
+    field_mask_(((uint64_t)1 << field_len_) - 1)
+  { }
+
+  // Entry of the mer x, y being its reverse complement: the key is
+  // stored in key and the field number is returned. suffix is scratch
+  // space.
+  static int neighbor_entry(const mer_dna& x, const mer_dna& y, mer_dna& key, mer_dna& suffix) {
+    suffix = x; // Bases 1 to k-1 of x
+    suffix.base(0) = 0;
+    key = y;           // Same (k-1)-mer, reverse complemented
+    key.shift_left(0);
+    if(!(key < suffix)) {
+      key = suffix;
+      return x.base(0).code();
+    }
+    key.base(0) = 1;
+    return mer_dna::complement(x.base(0).code());
+  }
+
+  uint64_t field(uint64_t v, int f) const { return (v >> (f * field_len_)) & field_mask_; }
+
+  virtual value_type get(const mer_dna& m) const {
+    mer_dna  key, tmp;
+    uint64_t v = 0;
+    const int f = neighbor_entry(m, m.get_reverse_complement(), key, tmp);
+    return keys_.get_val_for_key(key, &v) ? decode(field(v, f)) : value_type(0, 0);
+  }
+
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    for(size_t i = 0; i < n; ++i)
+      vals[i] = get(mers[i]);
+  }
+
+  // Only the first element of each group of mers and oids is used:
+  // the key of the entry and its hash position. field holds the side
+  // of the entry.
+  virtual void add_siblings(const mer_dna& x, const mer_dna& y, sibling_batch& batch) const {
+    mer_dna& key = batch.mers[4 * batch.size];
+    neighbor_entry(x, y, key, batch.tmp);
+    batch.field[batch.size]    = key.base(0).code();
+    batch.oids[4 * batch.size] = oid(key);
+    ++batch.size;
+  }
+
+  virtual void probe_siblings(const sibling_batch& batch, value_type* vals) const {
+    for(size_t i = 0; i < batch.size; ++i)
+      key_slots_.prefetch(batch.oids[4 * i]);
+    mer_dna tmp;
+    for(size_t i = 0; i < batch.size; ++i) {
+      uint64_t v = 0;
+      keys_.get_val_for_key(batch.mers[4 * i], &v, tmp, batch.oids[4 * i]);
+      // The field of the sibling with base 0 equal to b is b or its
+      // complement, depending on the side of the entry.
+      for(int b = 0; b < 4; ++b)
+        vals[4 * i + b] = decode(field(v, batch.field[i] == 0 ? b : mer_dna::complement(b)));
+    }
+  }
+
+  virtual cursor* new_cursor(bool with_keys) const { return new key_cursor(*this); }
+};
+
+#endif /* __QUORUM_DATABASE_BACKEND_HPP__ */
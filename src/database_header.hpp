@@ -0,0 +1,132 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_DATABASE_HEADER_HPP__
+#define __QUORUM_DATABASE_HEADER_HPP__
+
+#include <string>
+#include <vector>
+
+#include <jellyfish/file_header.hpp>
+#include <jellyfish/large_hash_array.hpp>
+#include <jellyfish/atomic_bits_array.hpp>
+#include <jellyfish/mer_dna.hpp>
+#include <jellyfish/rectangular_binary_matrix.hpp>
+
+using jellyfish::mer_dna;
+using jellyfish::RectangularBinaryMatrix;
+typedef jellyfish::large_hash::array<mer_dna> mer_array;
+typedef jellyfish::large_hash::array_raw<mer_dna> mer_array_raw;
+typedef jellyfish::atomic_bits_array<uint64_t> val_array;
+typedef jellyfish::atomic_bits_array_raw<uint64_t> val_array_raw;
+
+class database_header : public jellyfish::file_header {
+public:
+  database_header() : jellyfish::file_header() { }
+  database_header(std::istream& is) : jellyfish::file_header(is) { }
+
+  void bits(uint32_t b) { root_["bits"] = (Json::UInt)b; }
+  uint32_t bits() const { return root_["bits"].asUInt(); }
+
+  size_t value_bytes() const { return root_["value_bytes"].asLargestUInt(); }
+  void value_bytes(size_t bytes) { root_["value_bytes"] = (Json::UInt64)bytes; }
+
+  size_t key_bytes() const { return root_["key_bytes"].asLargestUInt(); }
+  void key_bytes(size_t bytes) { root_["key_bytes"] = (Json::UInt64)bytes; }
+
+  // Number of 64 bit words of a k-mer of the database. The same as
+  // mer_dna::nb_words() once mer_dna::k() is set from key_len(), but
+  // valid before.
+  unsigned int key_words() const { return (key_len() + 63) / 64; }
+
+  // Layout of the data after the header. "split" (the default): the
+  // key array followed by the value array. "packed": the values are
+  // stored in the value field of the key array.
+  std::string layout() const {
+    const Json::Value& l = root_["layout"];
+    return l.isNull() ? "split" : l.asString();
+  }
+  void layout(const std::string& l) { root_["layout"] = l; }
+
+  // For the "sharded" layout: the file has no data, the k-mers are in
+  // the shard files, one per minimizer partition. The paths are
+  // relative to the directory of the index file.
+  unsigned int minimizer_len() const { return root_["minimizer_len"].asUInt(); }
+  void minimizer_len(unsigned int m) { root_["minimizer_len"] = (Json::UInt)m; }
+
+  std::vector<std::string> shards() const {
+    const Json::Value&       s = root_["shards"];
+    std::vector<std::string> res;
+    for(unsigned int i = 0; i < s.size(); ++i)
+      res.push_back(s[i].asString());
+    return res;
+  }
+  void add_shard(const std::string& path) { root_["shards"].append(path); }
+
+  // File of the lookup filter, a Bloom filter of the k-mers, relative
+  // to the directory of the database. Empty if there is none.
+  std::string filter() const {
+    const Json::Value& f = root_["filter"];
+    return f.isNull() ? std::string() : f.asString();
+  }
+  void filter(const std::string& path) { root_["filter"] = path; }
+
+  // File of the hot table, the most frequent k-mers, relative to the
+  // directory of the database. Empty if there is none.
+  std::string hot() const {
+    const Json::Value& h = root_["hot"];
+    return h.isNull() ? std::string() : h.asString();
+  }
+  void hot(const std::string& path) { root_["hot"] = path; }
+
+  // For the "mphf" layout: number of k-mers and length of their
+  // fingerprints.
+  size_t nb_keys() const { return root_["nb_keys"].asLargestUInt(); }
+  void nb_keys(size_t n) { root_["nb_keys"] = (Json::UInt64)n; }
+
+  unsigned int fingerprint_bits() const { return root_["fingerprint_bits"].asUInt(); }
+  void fingerprint_bits(unsigned int b) { root_["fingerprint_bits"] = (Json::UInt)b; }
+
+  // For the "split" layout with an overflow table: the value array
+  // keeps counts of inline_bits bits, and a count with all these bits
+  // set is in the overflow table, of overflow_bytes bytes after the
+  // value array. bits() is the width of the counts in that table. 0 if
+  // there is no overflow table.
+  unsigned int inline_bits() const { return root_["inline_bits"].asUInt(); }
+  void inline_bits(unsigned int b) { root_["inline_bits"] = (Json::UInt)b; }
+
+  size_t overflow_bytes() const { return root_["overflow_bytes"].asLargestUInt(); }
+  void overflow_bytes(size_t bytes) { root_["overflow_bytes"] = (Json::UInt64)bytes; }
+
+  // For the "sketch" layout, which has no cursor over the values:
+  // estimated number of distinct high quality k-mers and their total
+  // count, computed while counting. 0 if unknown.
+  uint64_t distinct_high() const { return root_["distinct_high"].asLargestUInt(); }
+  void distinct_high(uint64_t n) { root_["distinct_high"] = (Json::UInt64)n; }
+
+  uint64_t total_high() const { return root_["total_high"].asLargestUInt(); }
+  void total_high(uint64_t n) { root_["total_high"] = (Json::UInt64)n; }
+
+  void set_format() {
+    this->format("binary/quorum_db");
+  }
+  bool check_format() const {
+    return "binary/quorum_db" == this->format();
+  }
+};
+
+#endif /* __QUORUM_DATABASE_HEADER_HPP__ */
@@ -32,6 +32,7 @@
 #include <gzip_stream.hpp>
 
 #include <src/mer_database.hpp>
+#include <src/fixed_mer.hpp>
 #include <src/error_correct_reads.hpp>
 #include <src/error_correct_reads_cmdline.hpp>
 #include <src/verbose_log.hpp>
@@ -98,7 +99,9 @@ public:
   }
 };
 
-template<class instance_t>
+// Each thread runs an instance_t<mer_t>, with mer_t the fastest mer
+// type for the k-mer length.
+template<template<typename> class instance_t>
 class error_correct_t : public jellyfish::thread_exec {
   read_parser            _parser;
   int                    _skip;
@@ -118,6 +121,8 @@ class error_correct_t : public jellyfish::thread_exec {
   double                 _collision_prob; // collision probability = a priori error rate / 3
   double                 _poisson_threshold;
   bool                   _no_discard;
+  unsigned int           _cache_bits;
+  uint64_t               _cache_hits, _cache_lookups;
 
   jflib::o_multiplexer * _output;
   jflib::o_multiplexer * _log;
@@ -126,7 +131,8 @@ public:
     _parser(4 * nb_threads, 100, 1, streams),
     _skip(0), _good(1), _min_count(1), _cutoff(4), _window(0), _error(0), _gzip(false),
     _mer_database(0), _contaminant(0), _trim_contaminant(false),
-    _homo_trim(std::numeric_limits<int>::min()), _no_discard(false) { }
+    _homo_trim(std::numeric_limits<int>::min()), _no_discard(false),
+    _cache_bits(0), _cache_hits(0), _cache_lookups(0) { }
 
 private:
   // Open the data (error corrected reads) and log files. Default to
@@ -171,7 +177,11 @@ public:
   }
 
   virtual void start(int id) {
-    instance_t(*this, id).start();
+    switch(fixed_mer_words(mer_dna::k())) {
+    case 1: instance_t<fixed_mer<1> >(*this, id).start(); break;
+    case 2: instance_t<fixed_mer<2> >(*this, id).start(); break;
+    default: instance_t<mer_dna>(*this, id).start(); break;
+    }
   }
 
   error_correct_t& skip(int s) { _skip = s; return *this; }
@@ -193,6 +203,7 @@ public:
   error_correct_t& collision_prob(double cp) { _collision_prob = cp; return *this; }
   error_correct_t& poisson_threshold(double t) { _poisson_threshold = t; return *this; }
   error_correct_t& no_discard(bool d) { _no_discard = d; return *this; }
+  error_correct_t& cache_bits(unsigned int b) { _cache_bits = b; return *this; }
 
   read_parser& parser() { return _parser; }
   int skip() const { return _skip; }
@@ -214,14 +225,27 @@ public:
   double collision_prob() const { return _collision_prob; }
   double poisson_threshold() const { return _poisson_threshold; }
   bool no_discard() const { return _no_discard; }
+  unsigned int cache_bits() const { return _cache_bits; }
+
+  // Statistics of the lookup caches, summed over the threads
+  void add_cache_stats(uint64_t hits, uint64_t lookups) {
+    __sync_fetch_and_add(&_cache_hits, hits);
+    __sync_fetch_and_add(&_cache_lookups, lookups);
+  }
+  uint64_t cache_hits() const { return _cache_hits; }
+  uint64_t cache_lookups() const { return _cache_lookups; }
 
   jflib::o_multiplexer& output() { return *_output; }
   jflib::o_multiplexer& log() { return *_log; }
 };
 
+template<typename mer_t>
 class error_correct_instance {
 public:
-  typedef error_correct_t<error_correct_instance> ec_t ;
+  typedef error_correct_t< ::error_correct_instance> ec_t;
+  typedef basic_kmer<mer_t>                         kmer_t;
+  typedef basic_forward_mer<kmer_t>                 forward_mer;
+  typedef basic_backward_mer<kmer_t>                backward_mer;
 
 private:
   ec_t&   _ec;
@@ -230,6 +254,11 @@ private:
   char*   _buffer;
   kmer_t  _tmp_mer;
   mer_dna _tmp_mer_dna;
+  mer_dna _canonical_mer_dna;
+
+  database_query::sibling_batch _batch;
+  database_query::sibling_batch _nbatch;
+  lookup_cache                  _cache;
 
   static const char* error_contaminant;
   static const char* error_no_starting_mer;
@@ -237,7 +266,7 @@ private:
 
 public:
   error_correct_instance(ec_t& ec, int id) :
-    _ec(ec), _buff_size(0), _buffer(0) { }
+    _ec(ec), _buff_size(0), _buffer(0), _cache(ec.cache_bits()) { }
     //    _ec(ec), _id(id), _buff_size(0), _buffer(0) { }
   ~error_correct_instance() {
     free(_buffer);
@@ -338,14 +367,21 @@ public:
     } // while(true)... loop over all jobs
     details.close();
     output.close();
+    _ec.add_cache_stats(_cache.hits(), _cache.lookups());
   }
 
 private:
   enum log_code { OK, TRUNCATE, ERROR };
 
+  // Canonical representation of mer as a mer_dna, for lookups
+  template<typename dir_mer>
+  const mer_dna& canonical(const dir_mer& mer) {
+    return to_mer_dna(mer.canonical(), _canonical_mer_dna);
+  }
+
   template<typename dir_mer, typename elog, typename counter>
   log_code check_contaminant(dir_mer& mer, elog& log, const counter& cpos, const char**error) {
-    if(_ec.contaminant()->is_contaminant(mer.canonical(), _tmp_mer_dna)) {
+    if(_ec.contaminant()->is_contaminant(canonical(mer), _tmp_mer_dna)) {
       if(_ec.trim_contaminant()) {
         log.truncation(cpos);
         return TRUNCATE;
@@ -387,7 +423,7 @@ private:
                 counter pos, in_dir_ptr end,
                 out_dir_ptr out, elog &log, const char** error) {
     counter  cpos       = pos;
-    uint32_t prev_count = _ec.mer_database()->get_val(mer.canonical());
+    uint32_t prev_count = _ec.mer_database()->get_val(canonical(mer), _cache);
 
     for( ; input < end; ++input, ++qual) {
       const char base = *input;
@@ -410,7 +446,7 @@ private:
       int      ucode = 0;
       int      level;
 
-      const int count = _ec.mer_database()->get_best_alternatives(mer, counts, ucode, level);
+      const int count = _ec.mer_database()->get_best_alternatives(mer, _batch, _cache, counts, ucode, level);
 
       // No coninuation whatsoever, trim.
       if(count == 0) {
@@ -482,6 +518,12 @@ private:
       if(input + 1 < end)
         read_nbase_code = mer_dna::code(*(input + 1));
 
+      // Look up the continuations of all the alternatives in one
+      // batch.
+      database_query::sibling_batch& batch = _nbatch;
+      std::pair<uint64_t, int>       nvals[16];
+      int                            alts[4];
+      batch.clear();
       for(int i = 0; i < 4; ++i) {
         cont_counts[i]                = 0;
         continue_with_correct_base[i] = false;
@@ -494,11 +536,17 @@ private:
         nmer.replace(0, check_code);
         // Does not matter what we shift, check all alternative anyway.
         nmer.shift(0);
+        alts[batch.size] = i;
+        _ec.mer_database()->add_alternatives(nmer, batch);
+      }
+      _ec.mer_database()->get_alternatives(batch, nvals);
 
+      for(size_t j = 0; j < batch.size; ++j) {
+        const int  i = alts[j];
         uint64_t   ncounts[4];
         int        nucode = 0;
         int        nlevel;
-        const int ncount = _ec.mer_database()->get_best_alternatives(nmer, ncounts, nucode, nlevel);
+        const int ncount = database_query::best_alternatives(nvals + 4 * j, ncounts, nucode, nlevel);
         if(ncount > 0 && nlevel >= level) {
           continue_with_correct_base[i] = read_nbase_code >= 0 && ncounts[read_nbase_code] > 0;
           success                       = true;
@@ -617,14 +665,14 @@ private:
       }
       int found = 0;
       while(input < end) {
-	bool contaminated = _ec.contaminant()->is_contaminant(mer.canonical(), _tmp_mer_dna);
+	bool contaminated = _ec.contaminant()->is_contaminant(canonical(mer), _tmp_mer_dna);
 	if(contaminated && !_ec.trim_contaminant()) {
 	  *error = error_contaminant;
 	  return false;
 	}
 
 	if(!contaminated) {
-	  hval_t val = _ec.mer_database()->get_val(mer.canonical());
+	  hval_t val = _ec.mer_database()->get_val(canonical(mer), _cache);
 
 	  found = (int)val >= _ec.anchor() ? found + 1 : 0;
 	  if(found >= _ec.good())
@@ -643,18 +691,27 @@ private:
   }
 };
 
-const char* error_correct_instance::error_contaminant     = "Contaminated read";
-const char* error_correct_instance::error_no_starting_mer = "No high quality mer";
-const char* error_correct_instance::error_homopolymer     = "Entire read is an homopolymer";
-
-unsigned int compute_poisson_cutoff__(const val_array_raw& counts, double collision_prob, double poisson_threshold) {
-  auto     it_end   = counts.end();
-  uint64_t distinct = 0;
-  uint64_t total    = 0;
-  for(auto it = counts.begin(); it != it_end; ++it) {
-    if((*it & 0x1) && (*it >= 2)) {
-      distinct += 1;
-      total    += *it >> 1;
+template<typename mer_t>
+const char* error_correct_instance<mer_t>::error_contaminant     = "Contaminated read";
+template<typename mer_t>
+const char* error_correct_instance<mer_t>::error_no_starting_mer = "No high quality mer";
+template<typename mer_t>
+const char* error_correct_instance<mer_t>::error_homopolymer     = "Entire read is an homopolymer";
+
+unsigned int compute_poisson_cutoff__(const database_query& db, const database_header& header,
+                                      double collision_prob, double poisson_threshold) {
+  // The sketch layout can not enumerate its counts: use the statistics
+  // saved in the header when it was built.
+  uint64_t distinct = header.distinct_high();
+  uint64_t total    = header.total_high();
+  if(!distinct) {
+    std::unique_ptr<database_backend::cursor> counts(db.backend().new_cursor(false));
+    while(counts->next()) {
+      const database_backend::value_type v = counts->val();
+      if(v.second) {
+        distinct += 1;
+        total    += v.first;
+      }
     }
   }
   const double coverage = (double)total / (double)distinct;
@@ -667,9 +724,10 @@ unsigned int compute_poisson_cutoff__(const val_array_raw& counts, double collis
   return 0;
 }
 
-unsigned int compute_poisson_cutoff(const val_array_raw& counts, double collision_prob, double poisson_threshold) {
+unsigned int compute_poisson_cutoff(const database_query& db, const database_header& header,
+                                    double collision_prob, double poisson_threshold) {
   vlog << "Computing Poisson cutoff";
-  unsigned int res = compute_poisson_cutoff__(counts, collision_prob, poisson_threshold);
+  unsigned int res = compute_poisson_cutoff__(db, header, collision_prob, poisson_threshold);
   return res;
 }
 
@@ -685,9 +743,15 @@ int main(int argc, char *argv[])
     (args.qual_cutoff_value_given ? (char)args.qual_cutoff_value_arg : std::numeric_limits<char>::max());
 
   verbose_log::verbose = args.verbose_flag;
+  // The layouts of the database need k
+  const database_header db_header = parse_database_header(args.db_arg);
+  mer_dna::k(db_header.key_len() / 2);
+  if(!args.cutoff_given && db_header.layout() == "sketch" && !db_header.distinct_high())
+    err::die(err::msg() << "The sketch database '" << args.db_arg
+             << "' has no k-mer statistics to compute the Poisson cutoff. Pass it explicitly with -p switch.");
   vlog << "Loading mer database";
-  database_query mer_database(args.db_arg, args.no_mmap_flag);
-  mer_dna::k(mer_database.header().key_len() / 2);
+  database_query mer_database(args.db_arg, load_options(args.no_mmap_flag, args.thread_arg,
+                                                        args.shm_given ? args.shm_arg : ""));
 
   // Open contaminant database.
   std::unique_ptr<contaminant_check> contaminant;
@@ -711,13 +775,13 @@ int main(int argc, char *argv[])
 
   const unsigned int cutoff =   args.cutoff_given ?
     args.cutoff_arg :
-    compute_poisson_cutoff(mer_database.vals(), args.apriori_error_rate_arg / 3,
+    compute_poisson_cutoff(mer_database, db_header, args.apriori_error_rate_arg / 3,
                            args.poisson_threshold_arg / args.apriori_error_rate_arg);
   vlog << "Using cutoff of " << cutoff;
   if(cutoff == 0 && !args.cutoff_given)
     err::die("Cutoff computation failed. Pass it explicitly with -p switch.");
 
-  error_correct_instance::ec_t correct(args.thread_arg, streams);
+  error_correct_t<error_correct_instance> correct(args.thread_arg, streams);
   correct.skip(args.skip_arg).good(args.good_arg)
     .anchor(args.anchor_count_arg)
     .prefix(args.output_given ? (std::string)args.output_arg : "")
@@ -733,9 +797,13 @@ int main(int argc, char *argv[])
     .homo_trim(args.homo_trim_given ? args.homo_trim_arg : std::numeric_limits<int>::min())
     .collision_prob(args.apriori_error_rate_arg / 3)
     .poisson_threshold(args.poisson_threshold_arg)
-    .no_discard(args.no_discard_flag);
+    .no_discard(args.no_discard_flag)
+    .cache_bits(args.cache_bits_arg);
   vlog << "Correcting reads";
   correct.do_it(args.thread_arg);
+  if(correct.cache_lookups() > 0)
+    vlog << "Lookup cache hit rate:" << (100.0 * correct.cache_hits() / correct.cache_lookups()) << "% of "
+         << correct.cache_lookups() << " lookups";
   vlog << "Done";
 
   return 0;
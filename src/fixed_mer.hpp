@@ -0,0 +1,127 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_FIXED_MER_HPP__
+#define __QUORUM_FIXED_MER_HPP__
+
+#include <stdint.h>
+#include <string>
+
+#include <jellyfish/mer_dna.hpp>
+
+// A k-mer stored in W 64 bit words, inline. It has the same layout as
+// jellyfish::mer_dna (base 0 in the low bits of word 0) and the same
+// order, so it can be copied into a mer_dna for hash lookups. k is
+// still mer_dna::k(), which must be at most 32 * W and more than
+// 32 * (W - 1). With W known at compile time, the loops over the
+// words unroll and copies do not allocate.
+template<unsigned int W>
+class fixed_mer {
+  uint64_t data_[W];
+
+  static unsigned int top_shift() { return 2 * ((jellyfish::mer_dna::k() - 1) % 32); }
+  static uint64_t top_mask() { return (uint64_t)-1 >> (62 - top_shift()); }
+
+public:
+  fixed_mer() {
+    for(unsigned int i = 0; i < W; ++i)
+      data_[i] = 0;
+  }
+
+  class base_proxy {
+    uint64_t&          word_;
+    const unsigned int shift_;
+  public:
+    base_proxy(uint64_t& word, unsigned int shift) : word_(word), shift_(shift) { }
+    base_proxy& operator=(int c) {
+      word_ = (word_ & ~((uint64_t)0x3 << shift_)) | ((uint64_t)c << shift_);
+      return *this;
+    }
+    int code() const { return (word_ >> shift_) & 0x3; }
+  };
+  class const_base_proxy {
+    const uint64_t     word_;
+    const unsigned int shift_;
+  public:
+    const_base_proxy(uint64_t word, unsigned int shift) : word_(word), shift_(shift) { }
+    int code() const { return (word_ >> shift_) & 0x3; }
+  };
+
+  base_proxy base(unsigned int i) { return base_proxy(data_[i / 32], 2 * (i % 32)); }
+  const_base_proxy base(unsigned int i) const { return const_base_proxy(data_[i / 32], 2 * (i % 32)); }
+
+  // Insert c as base 0, drop base k-1
+  void shift_left(int c) {
+    for(unsigned int i = W - 1; i > 0; --i)
+      data_[i] = (data_[i] << 2) | (data_[i - 1] >> 62);
+    data_[0]     = (data_[0] << 2) | (uint64_t)c;
+    data_[W - 1] &= top_mask();
+  }
+
+  // Insert c as base k-1, drop base 0
+  void shift_right(int c) {
+    for(unsigned int i = 0; i < W - 1; ++i)
+      data_[i] = (data_[i] >> 2) | (data_[i + 1] << 62);
+    data_[W - 1] = (data_[W - 1] >> 2) | ((uint64_t)c << top_shift());
+  }
+
+  bool operator==(const fixed_mer& rhs) const {
+    for(unsigned int i = 0; i < W; ++i)
+      if(data_[i] != rhs.data_[i])
+        return false;
+    return true;
+  }
+  bool operator!=(const fixed_mer& rhs) const { return !(*this == rhs); }
+  bool operator<(const fixed_mer& rhs) const {
+    for(unsigned int i = W - 1; i > 0; --i)
+      if(data_[i] != rhs.data_[i])
+        return data_[i] < rhs.data_[i];
+    return data_[0] < rhs.data_[0];
+  }
+
+  uint64_t word(unsigned int i) const { return data_[i]; }
+  void copy_to(jellyfish::mer_dna& m) const {
+    for(unsigned int i = 0; i < W; ++i)
+      m.word__(i) = data_[i];
+  }
+
+  std::string to_str() const {
+    std::string res(jellyfish::mer_dna::k(), 'A');
+    for(unsigned int i = 0; i < res.size(); ++i)
+      res[res.size() - 1 - i] = jellyfish::mer_dna::rev_code(base(i).code());
+    return res;
+  }
+};
+
+// View of a mer as a jellyfish::mer_dna, using tmp as storage if a
+// copy is needed.
+inline const jellyfish::mer_dna& to_mer_dna(const jellyfish::mer_dna& m, jellyfish::mer_dna& tmp) {
+  return m;
+}
+template<unsigned int W>
+const jellyfish::mer_dna& to_mer_dna(const fixed_mer<W>& m, jellyfish::mer_dna& tmp) {
+  m.copy_to(tmp);
+  return tmp;
+}
+
+// Number of words of the fixed_mer to use for k-mers of length k, or 0
+// to use jellyfish::mer_dna.
+inline unsigned int fixed_mer_words(unsigned int k) {
+  return k <= 32 ? 1 : (k <= 64 ? 2 : 0);
+}
+
+#endif /* __QUORUM_FIXED_MER_HPP__ */
@@ -0,0 +1,131 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_HOT_TABLE_HPP__
+#define __QUORUM_HOT_TABLE_HPP__
+
+#include <stdint.h>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/hyperloglog.hpp>
+
+// Small dense hash table of the most frequent k-mers of a database,
+// to keep the common lookups in the last level cache. Linear probing
+// at a load factor of at most 1/2, an entry is the words of the k-mer
+// followed by its value as stored in the database (count << 1 |
+// quality), 0 for an empty entry. It is not thread safe when
+// inserting.
+//
+// Binary form: the number of entries, the number of words of a k-mer
+// and the entries, as 64 bit words.
+class hot_table {
+  const unsigned int    nb_words_;
+  const unsigned int    entry_words_;
+  uint64_t              mask_;
+  std::vector<uint64_t> entries_;
+
+  static uint64_t read_word(std::istream& is) {
+    uint64_t w = 0;
+    is.read((char*)&w, sizeof(w));
+    if(!is.good())
+      throw std::runtime_error("Truncated hot table");
+    return w;
+  }
+
+  bool same_key(const uint64_t* e, const jellyfish::mer_dna& m) const {
+    for(unsigned int i = 0; i < nb_words_; ++i)
+      if(e[i] != m.word(i))
+        return false;
+    return true;
+  }
+
+public:
+  // Table with room for nb_mers k-mers
+  explicit hot_table(size_t nb_mers) :
+    nb_words_(jellyfish::mer_dna::nb_words()),
+    entry_words_(nb_words_ + 1),
+    mask_(1)
+  {
+    while(mask_ + 1 < 2 * nb_mers)
+      mask_ = 2 * mask_ + 1;
+    entries_.resize((mask_ + 1) * entry_words_, 0);
+  }
+
+  // Read a table written by write(), of k-mers of nb_words words:
+  // from the header of the database, as mer_dna::k() may not be set
+  // yet.
+  hot_table(std::istream& is, unsigned int nb_words) :
+    nb_words_(nb_words),
+    entry_words_(nb_words_ + 1)
+  {
+    const uint64_t size = read_word(is);
+    if(read_word(is) != nb_words_ || size == 0 || (size & (size - 1)))
+      throw std::runtime_error("Invalid hot table");
+    mask_ = size - 1;
+    entries_.resize(size * entry_words_);
+    is.read((char*)entries_.data(), entries_.size() * sizeof(uint64_t));
+    if(is.fail())
+      throw std::runtime_error("Truncated hot table");
+  }
+
+  void write(std::ostream& os) const {
+    const uint64_t sizes[2] = { mask_ + 1, nb_words_ };
+    os.write((const char*)sizes, sizeof(sizes));
+    os.write((const char*)entries_.data(), entries_.size() * sizeof(uint64_t));
+  }
+
+  size_t memory_usage() const { return entries_.size() * sizeof(uint64_t); }
+
+  static uint64_t hash(const jellyfish::mer_dna& m) { return mer_hash(m); }
+
+  // Insert m with the value val (not 0). Return false if the table is
+  // full.
+  bool insert(const jellyfish::mer_dna& m, uint64_t val) {
+    const uint64_t h = hash(m);
+    for(uint64_t i = 0; i <= mask_; ++i) {
+      uint64_t* const e = &entries_[((h + i) & mask_) * entry_words_];
+      if(e[nb_words_] == 0 || same_key(e, m)) {
+        for(unsigned int j = 0; j < nb_words_; ++j)
+          e[j] = m.word(j);
+        e[nb_words_] = val;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void prefetch_hash(uint64_t h) const { __builtin_prefetch(&entries_[(h & mask_) * entry_words_]); }
+
+  // Value of m, whose hash is h, or 0 if not in the table
+  uint64_t find_hash(const jellyfish::mer_dna& m, uint64_t h) const {
+    for(uint64_t i = 0; i <= mask_; ++i) {
+      const uint64_t* const e = &entries_[((h + i) & mask_) * entry_words_];
+      if(e[nb_words_] == 0)
+        return 0;
+      if(same_key(e, m))
+        return e[nb_words_];
+    }
+    return 0;
+  }
+  uint64_t find(const jellyfish::mer_dna& m) const { return find_hash(m, hash(m)); }
+};
+
+#endif /* __QUORUM_HOT_TABLE_HPP__ */
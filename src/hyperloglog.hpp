@@ -0,0 +1,88 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_HYPERLOGLOG_HPP__
+#define __QUORUM_HYPERLOGLOG_HPP__
+
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <jellyfish/mer_dna.hpp>
+
+// Murmur3 finalizer. Used to scramble the bits of a k-mer before
+// feeding it to a sketch.
+inline uint64_t mix_bits(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+inline uint64_t mer_hash(const jellyfish::mer_dna& m, uint64_t seed = 0) {
+  uint64_t h = seed;
+  for(unsigned int i = 0; i < jellyfish::mer_dna::nb_words(); ++i)
+    h = mix_bits(h ^ m.word(i));
+  return h;
+}
+
+// HyperLogLog estimator of the number of distinct elements. It is not
+// thread safe: use one sketch per thread and merge them at the end.
+class hyperloglog {
+  const unsigned int   p_;
+  std::vector<uint8_t> registers_;
+
+public:
+  explicit hyperloglog(unsigned int p = 14) : p_(p), registers_((size_t)1 << p, 0) { }
+
+  void add_hash(uint64_t h) {
+    const size_t   i    = h >> (64 - p_);
+    const uint64_t w    = (h << p_) | ((uint64_t)1 << (p_ - 1)); // Guard bit: rank <= 64 - p_ + 1
+    const uint8_t  rank = __builtin_clzll(w) + 1;
+    if(rank > registers_[i])
+      registers_[i] = rank;
+  }
+  void add(const jellyfish::mer_dna& m) { add_hash(mer_hash(m)); }
+
+  void merge(const hyperloglog& rhs) {
+    for(size_t i = 0; i < registers_.size(); ++i)
+      registers_[i] = std::max(registers_[i], rhs.registers_[i]);
+  }
+
+  // Relative standard error of the estimate
+  double error() const { return 1.04 / std::sqrt((double)registers_.size()); }
+
+  double estimate() const {
+    const double m     = registers_.size();
+    const double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double       sum   = 0;
+    size_t       zeros = 0;
+    for(auto it = registers_.cbegin(); it != registers_.cend(); ++it) {
+      sum   += std::ldexp(1.0, -(int)*it);
+      zeros += *it == 0;
+    }
+    const double e = alpha * m * m / sum;
+    if(e <= 2.5 * m && zeros > 0) // Small range correction: linear counting
+      return m * std::log(m / zeros);
+    return e;
+  }
+};
+
+#endif /* __QUORUM_HYPERLOGLOG_HPP__ */
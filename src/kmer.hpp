@@ -8,10 +8,15 @@
 
 #include <jellyfish/mer_dna.hpp>
 
-class kmer_t {
-  jellyfish::mer_dna _fmer, _rmer;
+// A k-mer and its reverse complement. mer_t is jellyfish::mer_dna or
+// a fixed_mer.
+template<typename mer_t>
+class basic_kmer {
+  mer_t _fmer, _rmer;
 
 public:
+  typedef mer_t mer_type;
+
   bool shift_left(char c) {
     int x = jellyfish::mer_dna::code(c);
     if(x != -1) {
@@ -23,7 +28,7 @@ public:
 
   void shift_left(int x) {
     _fmer.shift_left(x);
-    _rmer.shift_right(mer_dna::complement(x));
+    _rmer.shift_right(jellyfish::mer_dna::complement(x));
   }
 
   bool shift_right(char c) {
@@ -37,12 +42,12 @@ public:
 
   void shift_right(int x) {
     _fmer.shift_right(x);
-    _rmer.shift_left(mer_dna::complement(x));
+    _rmer.shift_left(jellyfish::mer_dna::complement(x));
   }
 
-  const jellyfish::mer_dna& canonical() const { return _fmer < _rmer ? _fmer : _rmer; }
-  const jellyfish::mer_dna& fmer() const { return _fmer; }
-  const jellyfish::mer_dna& rmer() const { return _rmer; }
+  const mer_t& canonical() const { return _fmer < _rmer ? _fmer : _rmer; }
+  const mer_t& fmer() const { return _fmer; }
+  const mer_t& rmer() const { return _rmer; }
 
   void replace(int i, int x) {
     _fmer.base(i)                               = x;
@@ -54,65 +59,72 @@ public:
   //  uint64_t rcode(int i) const { assert(i >= 0 && i < _k); return (_rmer >> (2*i)) & c3; }
   std::string str() const { return _fmer.to_str(); }
   std::string rstr() const { return _rmer.to_str(); }
-
-  friend std::ostream &operator<<(std::ostream &os, const kmer_t &mer);
-  friend class forward_mer;
-  friend class backward_mer;
 };
 
-std::ostream &operator<<(std::ostream &os, const kmer_t &mer) {
+template<typename mer_t>
+std::ostream &operator<<(std::ostream &os, const basic_kmer<mer_t> &mer) {
   return os << mer.str();
 }
 
-class forward_mer;
-class backward_mer;
+template<typename kmer_type> class basic_forward_mer;
+template<typename kmer_type> class basic_backward_mer;
 
-class forward_mer {
-  kmer_t& _m;
+template<typename kmer_type>
+class basic_forward_mer {
+  kmer_type& _m;
 public:
-  forward_mer(kmer_t& m) : _m(m) {}
-  backward_mer rev_mer() const;
+  static const bool forward = true;
+  basic_forward_mer(kmer_type& m) : _m(m) {}
+  basic_backward_mer<kmer_type> rev_mer() const;
   bool shift(char c) { return _m.shift_left(c); }
   void shift(int x) { _m.shift_left(x); }
   bool rev_shift(char c) { return _m.shift_right(c); }
   void rev_shift(int x) { _m.shift_right(x); }
-  const jellyfish::mer_dna& canonical() const { return _m.canonical(); }
+  const typename kmer_type::mer_type& canonical() const { return _m.canonical(); }
   char base(int i) const { return _m.base(i); }
   int code(int i) const { return _m.code(i); }
   void replace(int i, int x) { _m.replace(i, x); }
-  const jellyfish::mer_dna& rmer() const { return _m.rmer(); }
-  const kmer_t& kmer() const { return _m; }
-  friend std::ostream &operator<<(std::ostream &os, const forward_mer &mer);
+  const typename kmer_type::mer_type& rmer() const { return _m.rmer(); }
+  const kmer_type& kmer() const { return _m; }
 };
-inline std::ostream &operator<<(std::ostream &os, const forward_mer &mer) {
-  return os << mer._m.str();
+template<typename kmer_type>
+inline std::ostream &operator<<(std::ostream &os, const basic_forward_mer<kmer_type> &mer) {
+  return os << mer.kmer().str();
 }
 
-class backward_mer {
-  kmer_t& _m;
+template<typename kmer_type>
+class basic_backward_mer {
+  kmer_type& _m;
 public:
-  backward_mer(kmer_t& m) : _m(m) {}
-  forward_mer rev_mer() const;
+  static const bool forward = false;
+  basic_backward_mer(kmer_type& m) : _m(m) {}
+  basic_forward_mer<kmer_type> rev_mer() const;
   bool shift(char c) { return _m.shift_right(c); }
   void shift(int x) { _m.shift_right(x); }
   bool rev_shift(char c) { return _m.shift_left(c); }
   void rev_shift(int x) { _m.shift_left(x); }
-  const jellyfish::mer_dna& canonical() const { return _m.canonical(); }
+  const typename kmer_type::mer_type& canonical() const { return _m.canonical(); }
   char base(int i) const { return _m.base(jellyfish::mer_dna::k() - i - 1); }
   int code(int i) const { return _m.code(jellyfish::mer_dna::k() - i - 1); }
   void replace(int i, uint64_t c) { _m.replace(jellyfish::mer_dna::k() - i - 1, c); }
-  const kmer_t& kmer() const { return _m; }
-  friend std::ostream &operator<<(std::ostream &os, const backward_mer &mer);
+  const kmer_type& kmer() const { return _m; }
 };
-inline std::ostream &operator<<(std::ostream &os, const backward_mer &mer) {
-  return os << mer._m.str();
+template<typename kmer_type>
+inline std::ostream &operator<<(std::ostream &os, const basic_backward_mer<kmer_type> &mer) {
+  return os << mer.kmer().str();
 }
 
-inline backward_mer forward_mer::rev_mer() const {
-  return backward_mer(_m);
+template<typename kmer_type>
+inline basic_backward_mer<kmer_type> basic_forward_mer<kmer_type>::rev_mer() const {
+  return basic_backward_mer<kmer_type>(_m);
 }
-inline forward_mer backward_mer::rev_mer() const {
-  return forward_mer(_m);
+template<typename kmer_type>
+inline basic_forward_mer<kmer_type> basic_backward_mer<kmer_type>::rev_mer() const {
+  return basic_forward_mer<kmer_type>(_m);
 }
 
+typedef basic_kmer<jellyfish::mer_dna>   kmer_t;
+typedef basic_forward_mer<kmer_t>        forward_mer;
+typedef basic_backward_mer<kmer_t>       backward_mer;
+
 #endif
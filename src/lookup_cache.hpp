@@ -0,0 +1,108 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_LOOKUP_CACHE_HPP__
+#define __QUORUM_LOOKUP_CACHE_HPP__
+
+#include <stdint.h>
+#include <vector>
+#include <utility>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/hyperloglog.hpp>
+
+// Direct-mapped cache of database lookups, for the use of one
+// thread. The reads of a job overlap at high coverage, so the same
+// k-mers are looked up again and again. An entry holds either the
+// value of one k-mer, or the values of the 4 siblings of a k-mer (base
+// 0 replaced by A, C, G and T). The values are encoded as in the
+// database: (count << 1 | quality).
+//
+// An entry is the words of the key, a tag (0 when empty) and 4
+// values, i.e. 48 bytes for k <= 32. With 2^bits entries, bits = 14
+// fits in a 1MB L2 cache. bits = 0 disables the cache.
+class lookup_cache {
+public:
+  typedef std::pair<uint64_t, int> value_type;
+  enum kind { single = 1, siblings = 2 };
+
+private:
+  const unsigned int    nb_words_;
+  const unsigned int    entry_words_;
+  const uint64_t        mask_;
+  std::vector<uint64_t> entries_;
+  uint64_t              hits_, lookups_;
+
+  static unsigned int nb_values(kind k) { return k == single ? 1 : 4; }
+
+  // Key word i of m: base 0 is ignored for the siblings
+  static uint64_t key_word(const jellyfish::mer_dna& m, kind k, unsigned int i) {
+    return i == 0 && k == siblings ? m.word(0) & ~(uint64_t)0x3 : m.word(i);
+  }
+
+  uint64_t* entry(const jellyfish::mer_dna& m, kind k) {
+    uint64_t h = k;
+    for(unsigned int i = 0; i < nb_words_; ++i)
+      h = mix_bits(h ^ key_word(m, k, i));
+    return &entries_[(h & mask_) * entry_words_];
+  }
+
+public:
+  explicit lookup_cache(unsigned int bits) :
+    nb_words_(jellyfish::mer_dna::nb_words()),
+    entry_words_(nb_words_ + 5),
+    mask_(bits ? ((uint64_t)1 << bits) - 1 : 0),
+    entries_(bits ? entry_words_ << bits : 0, 0),
+    hits_(0), lookups_(0)
+  { }
+
+  bool enabled() const { return !entries_.empty(); }
+  uint64_t hits() const { return hits_; }
+  uint64_t lookups() const { return lookups_; }
+
+  // Get the value(s) of m in vals[0] (single) or vals[0..4)
+  // (siblings, vals[b] for base 0 equal to b). Return false if not
+  // in the cache.
+  bool get(const jellyfish::mer_dna& m, kind k, value_type* vals) {
+    if(!enabled())
+      return false;
+    ++lookups_;
+    const uint64_t* const e = entry(m, k);
+    if(e[nb_words_] != (uint64_t)k)
+      return false;
+    for(unsigned int i = 0; i < nb_words_; ++i)
+      if(e[i] != key_word(m, k, i))
+        return false;
+    for(unsigned int i = 0; i < nb_values(k); ++i)
+      vals[i] = value_type(e[nb_words_ + 1 + i] >> 1, e[nb_words_ + 1 + i] & 0x1);
+    ++hits_;
+    return true;
+  }
+
+  void put(const jellyfish::mer_dna& m, kind k, const value_type* vals) {
+    if(!enabled())
+      return;
+    uint64_t* const e = entry(m, k);
+    for(unsigned int i = 0; i < nb_words_; ++i)
+      e[i] = key_word(m, k, i);
+    e[nb_words_] = k;
+    for(unsigned int i = 0; i < nb_values(k); ++i)
+      e[nb_words_ + 1 + i] = (vals[i].first << 1) | vals[i].second;
+  }
+};
+
+#endif /* __QUORUM_LOOKUP_CACHE_HPP__ */
@@ -19,6 +19,19 @@
 #define __QUORUM_MER_DATABASE_HPP__
 
 #include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <jellyfish/file_header.hpp>
 #include <jellyfish/large_hash_array.hpp>
@@ -29,175 +42,1022 @@
 #include <jellyfish/err.hpp>
 #include <jellyfish/locks_pthread.hpp>
 #include <jellyfish/atomic_field.hpp>
+#include <jellyfish/thread_exec.hpp>
 
 #include <src/verbose_log.hpp>
+#include <src/database_header.hpp>
+#include <src/database_backend.hpp>
+#include <src/mphf_database.hpp>
+#include <src/cuckoo_database.hpp>
+#include <src/sketch_database.hpp>
+#include <src/fixed_mer.hpp>
+#include <src/minimizer.hpp>
+#include <src/hyperloglog.hpp>
+#include <src/bloom_filter.hpp>
+#include <src/lookup_cache.hpp>
+#include <src/hot_table.hpp>
 
 namespace err = jellyfish::err;
 
-using jellyfish::mer_dna;
-typedef jellyfish::large_hash::array<mer_dna> mer_array;
-typedef jellyfish::large_hash::array_raw<mer_dna> mer_array_raw;
-typedef jellyfish::atomic_bits_array<uint64_t> val_array;
-typedef jellyfish::atomic_bits_array_raw<uint64_t> val_array_raw;
+// Store a value in the value field of a key array: the packed layout.
+struct packed_inserter {
+  bool operator()(mer_array& ary, const mer_dna& m, uint64_t v) const {
+    bool   is_new;
+    size_t id;
+    return ary.add(m, v, &is_new, &id);
+  }
+};
 
-class database_header : public jellyfish::file_header {
+// Store a value in the two entries of a k-mer in the neighbor
+// layout. The fields of different k-mers do not overlap, so adding the
+// shifted value sets the field.
+class neighbor_inserter {
+  const unsigned int field_len_;
 public:
-  database_header() : jellyfish::file_header() { }
-  database_header(std::istream& is) : jellyfish::file_header(is) { }
+  explicit neighbor_inserter(unsigned int field_len) : field_len_(field_len) { }
+  bool operator()(mer_array& ary, const mer_dna& m, uint64_t v) const {
+    bool          is_new;
+    size_t        id;
+    mer_dna       key1, key2, tmp;
+    const mer_dna rc = m.get_reverse_complement();
+    const int     f1 = neighbor_database::neighbor_entry(m, rc, key1, tmp);
+    const int     f2 = neighbor_database::neighbor_entry(rc, m, key2, tmp);
+    if(!ary.add(key1, v << (f1 * field_len_), &is_new, &id))
+      return false;
+    if(f1 == f2 && key1 == key2) // Palindrome
+      return true;
+    return ary.add(key2, v << (f2 * field_len_), &is_new, &id);
+  }
+};
+
+// Copy the entries of a table (count >= 1) into a new key array with
+// an Inserter, each thread doing one slice of the table.
+template<typename Inserter>
+class database_builder : public jellyfish::thread_exec {
+  const mer_array_raw& keys_;
+  const val_array_raw& vals_;
+  mer_array&           ary_;
+  const Inserter     insert_;
+  const int          nb_threads_;
+  volatile bool      full_;
+
+public:
+  database_builder(const mer_array_raw& keys, const val_array_raw& vals, mer_array& ary, const Inserter& insert,
+                   int nb_threads) :
+    keys_(keys), vals_(vals), ary_(ary), insert_(insert), nb_threads_(nb_threads), full_(false)
+  { }
+
+  virtual void start(int thid) {
+    auto it = keys_.eager_slice(thid, nb_threads_);
+    while(it.next() && !full_) {
+      const uint64_t v = vals_[it.id()];
+      if(v >= 2 && !insert_(ary_, it.key(), v))
+        full_ = true;
+    }
+  }
+
+  bool full() const { return full_; }
+};
+
+// Memory of a hash_with_quality table: anonymous, or a shared mapping
+// of a file. In the latter case, the file starts with a header,
+// followed by the data, so that it is a database as soon as it is
+// created. The file is removed on destruction unless it was kept.
+class table_memory {
+  char*        base_;
+  size_t       len_;
+  size_t       offset_;
+  std::string  path_;
+  bool         keep_;
 
-  void bits(uint32_t b) { root_["bits"] = (Json::UInt)b; }
-  uint32_t bits() const { return root_["bits"].asUInt(); }
+  table_memory(const table_memory&);
+  table_memory& operator=(const table_memory&);
 
-  size_t value_bytes() const { return root_["value_bytes"].asLargestUInt(); }
-  void value_bytes(size_t bytes) { root_["value_bytes"] = (Json::UInt64)bytes; }
+public:
+  define_error_class(ErrorMapping);
 
-  size_t key_bytes() const { return root_["key_bytes"].asLargestUInt(); }
-  void key_bytes(size_t bytes) { root_["key_bytes"] = (Json::UInt64)bytes; }
+  explicit table_memory(size_t len) : len_(len), offset_(0), keep_(false) {
+    void* const base = mmap(0, len_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+      throw ErrorMapping(err::msg() << "Failed to allocate " << len_ << " bytes" << err::no);
+    base_ = (char*)base;
+  }
+
+  table_memory(const std::string& path, const std::string& header, size_t len) :
+    len_(header.size() + len), offset_(header.size()), path_(path), keep_(false)
+  {
+    const int fd = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0)
+      throw ErrorMapping(err::msg() << "Can't open file '" << path_ << "'" << err::no);
+    if(ftruncate(fd, len_) < 0 || pwrite(fd, header.data(), header.size(), 0) != (ssize_t)header.size()) {
+      close(fd);
+      unlink(path_.c_str());
+      throw ErrorMapping(err::msg() << "Can't write to file '" << path_ << "'" << err::no);
+    }
+    void* const base = mmap(0, len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+      unlink(path_.c_str());
+      throw ErrorMapping(err::msg() << "Can't map file '" << path_ << "'" << err::no);
+    }
+    base_ = (char*)base;
+  }
 
-  void set_format() {
-    this->format("binary/quorum_db");
+  ~table_memory() {
+    munmap(base_, len_);
+    if(!path_.empty() && !keep_)
+      unlink(path_.c_str());
   }
-  bool check_format() const {
-    return "binary/quorum_db" == this->format();
+
+  char* data() const { return base_ + offset_; }
+  bool file_backed() const { return !path_.empty(); }
+
+  // Flush the mapping and move the file to path, where it is kept
+  void keep_as(const std::string& path) {
+    if(msync(base_, len_, MS_SYNC) < 0)
+      throw ErrorMapping(err::msg() << "Failed to write file '" << path_ << "'" << err::no);
+    if(rename(path_.c_str(), path.c_str()) < 0)
+      throw ErrorMapping(err::msg() << "Failed to rename '" << path_ << "' to '" << path << "'" << err::no);
+    path_ = path;
+    keep_ = true;
   }
 };
 
+// Hash of k-mers with a count and a quality bit. The value stored for
+// a k-mer is (count << 1 | quality). High quality wins: a high quality
+// occurrence resets the count of a k-mer seen only in low quality, and
+// low quality occurrences of a high quality k-mer are ignored. Counts
+// saturate at max_val_.
+//
+// When the table is full, a table twice the size is allocated and
+// becomes the current table immediately: inserts go to the new table
+// while the entries of the old table are migrated across, one slice
+// at a time, by the threads calling add(). Merging a count from the
+// old table into the new one follows the same rules as add(), so the
+// order does not matter. A migrated entry of the old table is replaced
+// by the 'moved' value, which tells late inserters to retry in the new
+// table. No thread ever waits for all the others.
+//
+// The old table is freed once every add() in flight when it was
+// retired has returned. Each thread announces when it is inside add()
+// with an odd epoch in its thread_record.
 class hash_with_quality {
-  mer_array*                         keys_;
-  mer_array*                         new_keys_;
-  val_array*                         vals_;
-  val_array*                         new_vals_;
-  const uint64_t                     max_val_;
-  jellyfish::locks::pthread::barrier size_barrier_;
-  jflib::atomic_field<uint16_t>       done_threads_;
-  jflib::atomic_field<uint16_t>        size_thid_;
-  const uint16_t                     nb_threads_;
-  enum status { OK, DONE, FULL };
+  struct table {
+    const size_t    key_bytes;
+    const size_t    val_bytes;
+    std::unique_ptr<table_memory> mem;
+    mer_array_raw   keys;
+    val_array_raw   vals;
+    table*          prev;        // Table migrated into this one, if any
+    const size_t    slice_len;
+    const size_t    nb_slices;
+    volatile size_t next_slice;  // Next slice of prev to migrate
+    volatile size_t done_slices; // Number of slices of prev migrated
+    bool            evict;       // Drop the low quality singletons of prev
+    volatile size_t evicted;     // Number of k-mers of prev dropped
+
+    // Entries of prev that did not fit in this table. They go into
+    // the next table when it is allocated.
+    std::vector<std::pair<mer_dna, uint64_t> > overflow;
+    jellyfish::locks::pthread::mutex            overflow_mutex;
+
+    // New table of size entries (a power of 2). If path is not empty,
+    // the table is in the file path, after a header in the split
+    // layout based on header.
+    table(size_t size, uint16_t key_len, int val_bits, uint16_t reprobe_limit, const size_t* reprobes,
+          const RectangularBinaryMatrix& matrix, const std::string& path, const database_header& header,
+          table* from) :
+      key_bytes(key_array_bytes(size, key_len, reprobe_limit)),
+      val_bytes(val_array_bytes(size, val_bits)),
+      mem(path.empty()
+          ? new table_memory(key_bytes + val_bytes)
+          : new table_memory(path, split_header(header, matrix, size, key_len, val_bits, reprobe_limit, reprobes,
+                                                key_bytes, val_bytes),
+                             key_bytes + val_bytes)),
+      keys(mem->data(), key_bytes, size, key_len, 0, reprobe_limit, matrix, reprobes),
+      vals(mem->data() + key_bytes, val_bytes, val_bits, size),
+      prev(from),
+      slice_len(from ? std::min(from->keys.size(), (size_t)4096) : 0),
+      nb_slices(from ? from->keys.size() / slice_len : 0),
+      next_slice(0), done_slices(0), evict(false), evicted(0)
+    { }
+  };
+
+  // Size of a table, rounded up to a power of 2
+  static size_t table_size(size_t size) {
+    size_t res = 2;
+    while(res < size)
+      res *= 2;
+    return res;
+  }
+  static size_t key_array_bytes(size_t size, uint16_t key_len, uint16_t reprobe_limit) {
+    return mer_array_raw::usage_info(key_len, 0, reprobe_limit).mem(size);
+  }
+  static size_t val_array_bytes(size_t size, int val_bits) {
+    const size_t per_word = 64 / val_bits;
+    return (size / per_word + (size % per_word != 0)) * sizeof(uint64_t);
+  }
+  static RectangularBinaryMatrix random_matrix(size_t size, uint16_t key_len) {
+    unsigned int lsize = 0;
+    while(((size_t)1 << lsize) < size)
+      ++lsize;
+    RectangularBinaryMatrix res(lsize, key_len);
+    res.randomize_pseudo_inverse();
+    return res;
+  }
+  // Header of a table written in place
+  static std::string split_header(database_header header, const RectangularBinaryMatrix& matrix, size_t size,
+                                  uint16_t key_len, int val_bits, uint16_t reprobe_limit, const size_t* reprobes,
+                                  size_t key_bytes, size_t val_bytes) {
+    header.set_format();
+    header.layout("split");
+    header.size(size);
+    header.key_len(key_len);
+    header.val_len(0);
+    header.matrix(matrix, 1);
+    header.matrix(matrix.pseudo_inverse(), 2);
+    header.max_reprobe(reprobe_limit);
+    header.set_reprobes(reprobes);
+    header.bits(val_bits - 1);
+    header.key_bytes(key_bytes);
+    header.value_bytes(val_bytes);
+    std::ostringstream os;
+    header.write(os);
+    return os.str();
+  }
+  struct thread_record {
+    volatile uint64_t epoch;
+    char              padding_[64 - sizeof(uint64_t)]; // Avoid false sharing
+  };
+
+  static const uint64_t moved     = 1; // Count of 0, never a valid value
+  static const uint64_t singleton = 1 << 1; // Low quality k-mer seen once
+  enum status { OK, RETRY, FULL };
+  enum growth { DOUBLE, EVICT, NONE };
+
+  const std::string           path_; // Build in this file if not empty
+  const database_header       header_;
+  unsigned int                generation_;
+  table* volatile             current_;
+  const uint64_t              max_val_;
+  const unsigned int          bits_;
+  const uint64_t              escape_; // Count of the entries in overflow_, 0 if none
+  std::unique_ptr<hash_with_quality> overflow_;
+  volatile bool               full_;
+  volatile int                resizing_;
+  bool                        prefiltered_;
+  size_t                      max_memory_;
+  volatile size_t             evicted_;
+  std::vector<thread_record>  records_;
+  volatile uint32_t           nb_records_;
+  pthread_key_t               record_key_;
+
+  // Initial size of the overflow table
+  static const size_t overflow_size = 1 << 16;
+  // Entries of a full table sampled to decide between eviction and
+  // doubling, and fraction of them which must be low quality
+  // singletons to evict.
+  static const size_t eviction_samples = 1 << 12;
+  static const size_t min_evicted_frac = 8; // 1 / 8
+
+  // Bits of the counts in the value array
+  static int inline_bits(int bits, int inline_bits) {
+    return inline_bits > 0 && inline_bits < bits ? inline_bits : bits;
+  }
 
 public:
-  hash_with_quality(size_t size, uint16_t key_len, int bits, uint16_t nb_threads, uint16_t reprobe_limit = 126) :
-    keys_(new mer_array(size, key_len, 0, reprobe_limit)),
-    new_keys_(0),
-    vals_(new val_array(bits + 1, keys_->size())),
-    new_vals_(0),
+  // If path is given, the table is built in place in a file: see
+  // write_in_place(). If inline_bits is less than bits, the value
+  // array keeps counts of inline_bits bits. The larger counts are in
+  // an overflow table, another hash_with_quality: most k-mers have a
+  // small count.
+  hash_with_quality(size_t size, uint16_t key_len, int bits, uint16_t nb_threads, uint16_t reprobe_limit = 126,
+                    const char* path = 0, const database_header& header = database_header(),
+                    int inline_bits = 0) :
+    path_(path ? path : ""), header_(header), generation_(0),
+    current_(new_table(table_size(size), key_len, hash_with_quality::inline_bits(bits, inline_bits) + 1,
+                       reprobe_limit, jellyfish::large_hash::quadratic_reprobes, 0)),
     max_val_((uint64_t)-1 >> (sizeof(uint64_t) * 8 - bits)),
-    size_barrier_(nb_threads),
-    done_threads_(0), size_thid_(0),
-    nb_threads_(nb_threads)
-  { }
+    bits_(bits),
+    escape_(hash_with_quality::inline_bits(bits, inline_bits) < bits
+            ? ((uint64_t)1 << hash_with_quality::inline_bits(bits, inline_bits)) - 1 : 0),
+    overflow_(escape_ ? new hash_with_quality(overflow_size, key_len, bits, nb_threads, reprobe_limit) : 0),
+    full_(false), resizing_(0), prefiltered_(false), max_memory_(0), evicted_(0),
+    records_(nb_threads + 1),
+    nb_records_(0)
+  {
+    if(pthread_key_create(&record_key_, 0))
+      throw std::runtime_error(err::msg() << "Failed to create thread key" << err::no);
+  }
 
   ~hash_with_quality() {
-    delete keys_;
-    delete vals_;
+    pthread_key_delete(record_key_);
+    delete current_->prev;
+    delete current_;
   }
 
-  bool add(const mer_dna& key, unsigned int quality) {
-    bool is_new;
-    size_t id;
-    while(__builtin_expect(!keys_->set(key, &is_new, &id), 0)) {
-      if(handle_full_ary() == FULL)
-        return false;
-    }
+  bool add(const mer_dna& key, unsigned int quality) { return add_val(key, (1 << 1) | quality); }
 
-    auto     entry = (*vals_)[id];
-    uint64_t nval = entry.get();;
-    do {
-      if((nval & 1) < quality)
-        nval = 3;
-      else if((nval >> 1) == max_val_ || (nval & 1) > quality)
-        return true;
-      else
-        nval += 2;
-    } while(__builtin_expect(!entry.set(nval), 0));
-    return true;
+  // Merge the value v, as stored in the table, into the entry for
+  // key. v must not be 0 or moved.
+  bool add_val(const mer_dna& key, uint64_t v) {
+    return add_entry(record(), key, v, prefiltered_, false) == OK;
   }
 
+  // Write in the split layout. The overflow table, if any, is written
+  // after the value array.
   void write(std::ostream& os, database_header* header = 0) const {
+    const table&      t        = *current_;
+    const std::string overflow = overflow_data();
+    if(header) {
+      header->set_format();
+      header->layout("split");
+      header->update_from_ary(t.keys);
+      header->bits(bits_);
+      header->key_bytes(t.key_bytes);
+      header->value_bytes(t.val_bytes);
+      if(overflow_) {
+        header->inline_bits(t.vals.bits() - 1);
+        header->overflow_bytes(overflow.size());
+      }
+      header->write(os);
+    }
+    os.write(t.mem->data(), t.key_bytes + t.val_bytes);
+    os.write(overflow.data(), overflow.size());
+  }
+
+  // For a table built in place: flush it to its file and move the file
+  // to the path given to the constructor. The file is a database in
+  // the split layout, its header was written when the table was
+  // created, and is copied into header if given. Until then, the
+  // table is in the file <path>.tmp<n>, also a valid database: after a
+  // crash, it has the k-mers counted so far, except for a table grown
+  // during a migration.
+  void write_in_place(database_header* header = 0) {
+    const table& t = *current_;
+    if(!t.mem->file_backed())
+      throw std::logic_error("Table not built in a file");
+    if(overflow_)
+      throw std::logic_error("Table with an overflow table built in a file");
+    t.mem->keep_as(path_);
+    if(header) {
+      header->set_format();
+      header->layout("split");
+      header->update_from_ary(t.keys);
+      header->bits(t.vals.bits() - 1);
+      header->key_bytes(t.key_bytes);
+      header->value_bytes(t.val_bytes);
+    }
+  }
+
+  // Write in the packed layout: the values are copied, with nb_threads
+  // threads, into the value field of a new key array. This needs
+  // memory for a second copy of the table.
+  void write_packed(std::ostream& os, database_header* header = 0, int nb_threads = 1) const {
+    const table& t = *current_;
+    write_rebuilt(os, header, nb_threads, "packed", t.vals.bits(), t.keys.size(), packed_inserter());
+  }
+
+  // Write in the neighbor layout (see neighbor_database). The new
+  // array has about twice as many entries as the table, and 4 values
+  // per entry.
+  void write_neighbor(std::ostream& os, database_header* header = 0, int nb_threads = 1) const {
+    const table& t = *current_;
+    if(!neighbor_layout_fits(t.vals.bits() - 1))
+      throw std::runtime_error(err::msg() << "Too many bits (" << (t.vals.bits() - 1) << ") for the neighbor layout");
+    write_rebuilt(os, header, nb_threads, "neighbor", 4 * t.vals.bits(), 2 * t.keys.size(),
+                  neighbor_inserter(t.vals.bits()));
+  }
+  static bool neighbor_layout_fits(unsigned int bits) { return 4 * (bits + 1) < 64; }
+
+  // Write in the sketch layout (see sketch_database). The counts are
+  // in sketch, and this table has the sightings of the k-mers after
+  // their count saturated the sketch: they become the heavy hitters.
+  void write_sketch(std::ostream& os, const count_min_sketch& sketch, database_header* header = 0) const {
+    if(overflow_)
+      throw std::runtime_error("The sketch layout does not support an overflow table");
+    const table& t        = *current_;
+    size_t       nb_heavy = 0;
+    {
+      auto it = t.keys.eager_slice(0, 1);
+      while(it.next())
+        nb_heavy += t.vals[it.id()] >= 2;
+    }
+    hot_table heavy(nb_heavy);
+    {
+      auto it = t.keys.eager_slice(0, 1);
+      while(it.next()) {
+        const uint64_t v = t.vals[it.id()];
+        if(v < 2)
+          continue;
+        const uint64_t h    = count_min_sketch::hash(it.key());
+        const uint64_t high = sketch.estimate(h, 1) + (v & 1 ? v >> 1 : 0);
+        const uint64_t low  = sketch.estimate(h, 0) + (v & 1 ? 0 : v >> 1);
+        heavy.insert(it.key(), high ? (std::min(high, max_val_) << 1) | 1 : std::min(low, max_val_) << 1);
+      }
+    }
+    vlog << "Heavy hitters in the sketch database:" << nb_heavy;
+
+    std::ostringstream heavy_os;
+    heavy.write(heavy_os);
+    const std::string heavy_data = heavy_os.str();
     if(header) {
       header->set_format();
-      header->update_from_ary(*keys_);
-      header->bits(vals_->bits() - 1);
-      header->key_bytes(keys_->size_bytes());
-      header->value_bytes(vals_->size_bytes());
+      header->layout("sketch");
+      header->update_from_ary(t.keys);
+      header->bits(t.vals.bits() - 1);
       header->write(os);
     }
-    keys_->write(os);
-    vals_->write(os);
+    // Align the blocks on cache lines
+    static const char zeros[64] = { 0 };
+    const uint64_t    sizes[2]  = { sketch.nb_blocks(), heavy_data.size() };
+    const uint64_t    start     = (uint64_t)os.tellp() + sizeof(sizes) + heavy_data.size();
+    os.write((const char*)sizes, sizeof(sizes));
+    os.write(heavy_data.data(), heavy_data.size());
+    os.write(zeros, (64 - start % 64) % 64);
+    os.write((const char*)sketch.blocks(), sketch.memory_usage());
+  }
+
+  // Called by every thread when done adding. Help finish the
+  // migration in progress, if any. Then add back the entries which
+  // did not fit in the table during the migration: no later add() may
+  // grow the table and take them along. Return false if the hash is
+  // full, and some k-mers were lost.
+  bool done() {
+    thread_record& rec = record();
+    while(true) {
+      bool pending;
+      do {
+        enter(rec);
+        table* const t       = current_;
+        table* const retired = migrate_slice(t);
+        pending              = t->prev != 0;
+        exit(rec);
+        if(retired)
+          reclaim(retired);
+      } while(pending);
+
+      // Take the entries set aside unless a new migration started. No
+      // thread is in grow(), which also reads them.
+      std::vector<std::pair<mer_dna, uint64_t> > entries;
+      enter(rec);
+      while(!__sync_bool_compare_and_swap(&resizing_, 0, 1))
+        sched_yield();
+      table* const t = current_;
+      pending        = t->prev != 0;
+      if(!pending) {
+        t->overflow_mutex.lock();
+        entries.swap(t->overflow);
+        t->overflow_mutex.unlock();
+      }
+      __sync_synchronize();
+      resizing_ = 0;
+      exit(rec);
+      if(!pending && entries.empty())
+        break;
+      for(auto it = entries.cbegin(); it != entries.cend(); ++it)
+        add_entry(rec, it->first, it->second, false, escaped(it->second));
+    }
+    const bool overflow_done = !overflow_ || overflow_->done();
+    return overflow_done && !full_;
+  }
+
+  // Drop the entries whose count is less than min_count[quality], and
+  // rehash the others, with nb_threads threads, into the smallest
+  // table with a load of at most load_factor. After the doublings while
+  // counting, the table is often less than half full. The entries
+  // whose count is in the overflow table are kept. Must be called after
+  // done(), before writing.
+  void compact(const uint64_t min_count[2], double load_factor, int nb_threads) {
+    table* const t = current_;
+    if(t->prev)
+      throw std::logic_error("Compacting a table during a migration");
+    if(t->mem->file_backed())
+      throw std::logic_error("Compacting a table built in a file");
+
+    compactor counter(*this, *t, 0, min_count, nb_threads);
+    counter.exec_join(nb_threads);
+    std::unique_ptr<table> nt;
+    for(size_t size = table_size(counter.kept() / load_factor + 1); true; size *= 2) {
+      nt.reset(new_table(size, t->keys.key_len(), t->vals.bits(), t->keys.max_reprobe(), t->keys.reprobes(), 0));
+      compactor builder(*this, *t, nt.get(), min_count, nb_threads);
+      builder.exec_join(nb_threads);
+      if(!builder.full())
+        break;
+    }
+    vlog << "Compacted hash from " << t->keys.size() << " to " << nt->keys.size() << " entries, kept "
+         << counter.kept() << " k-mers";
+    current_ = nt.release();
+    delete t;
   }
 
-  void done() {
-    done_threads_ += 1;
-    while(handle_full_ary() == OK);
+  uint64_t max_val() const { return max_val_; }
+
+  // Set when the low quality k-mers are added only from their second
+  // sighting on, the first one being recorded in a Bloom filter. The
+  // first sighting is then counted when a low quality k-mer is added
+  // for the first time. A false positive of the filter, or the
+  // addition of a k-mer not yet migrated by a resize, adds one to the
+  // count of a low quality k-mer. High quality counts are exact.
+  void prefiltered(bool p) { prefiltered_ = p; }
+  bool prefiltered() const { return prefiltered_; }
+
+  // Memory bounded mode: the tables, including the old one during a
+  // migration, use at most bytes. When the table is full, and many of
+  // its entries are low quality k-mers seen once, or doubling it
+  // would exceed the bound, these singletons are evicted instead: the
+  // table is migrated into a new table of the same size without them.
+  // An evicted k-mer seen again starts over from a count of 1, so the
+  // low quality counts are approximate. High quality counts are exact.
+  // 0, the default, for no bound. The bound covers only the main
+  // table: not the overflow table, nor the table built by compact().
+  void max_memory(size_t bytes) { max_memory_ = bytes; }
+  size_t max_memory() const { return max_memory_; }
+  // Number of k-mers evicted so far
+  size_t evicted() const { return evicted_; }
+  // Bytes of the current table
+  size_t memory() const { return current_->key_bytes + current_->val_bytes; }
+  mer_array_raw& keys() { return current_->keys; }
+  val_array_raw& vals() { return current_->vals; }
+
+  // Merge two values: the higher quality wins, equal qualities add up
+  // their counts (saturating at max_val).
+  static uint64_t merge_vals(uint64_t cur, uint64_t v, uint64_t max_val) {
+    if((cur & 1) != (v & 1))
+      return (cur & 1) > (v & 1) ? cur : v;
+    return (std::min(max_val, (cur >> 1) + (v >> 1)) << 1) | (cur & 1);
   }
 
-  mer_array& keys() { return *keys_; }
-  val_array& vals() { return *vals_; }
+  // Approximate number of bytes used by a table created with these
+  // parameters. The size is rounded up to a power of 2 and the keys
+  // are stored without the bits implied by their position.
+  static size_t memory_usage(size_t size, uint16_t key_len, int bits, uint16_t reprobe_limit = 126) {
+    unsigned int lsize = 0;
+    while(((size_t)1 << lsize) < size)
+      ++lsize;
+    unsigned int reprobe_bits = 0;
+    while(((size_t)1 << reprobe_bits) < (size_t)reprobe_limit + 2)
+      ++reprobe_bits;
+    const size_t key_bits = (key_len > lsize ? key_len - lsize : 0) + reprobe_bits;
+    return (((size_t)1 << lsize) * (key_bits + bits + 1) + 7) / 8;
+  }
 
 private:
-  status handle_full_ary() {
-    bool serial_thread = size_barrier_.wait();
-    if(done_threads_ >= nb_threads_) // All done?
-      return DONE;
-
-    if(serial_thread) {
-      new_keys_ = 0;
-      new_vals_ = 0;
-      try {
-        new_keys_ = new mer_array(keys_->size() * 2, keys_->key_len(), keys_->val_len(),
-                                  keys_->max_reprobe(), keys_->reprobes());
-        new_vals_ = new val_array(vals_->bits(), new_keys_->size());
-      } catch(...) {
-        delete new_keys_;
-        delete new_vals_;
-        new_keys_ = 0;
-        new_vals_ = 0;
+  // Copy the table into a new key array with the inserter and write
+  // it. The array is doubled until everything fits.
+  template<typename Inserter>
+  void write_rebuilt(std::ostream& os, database_header* header, int nb_threads, const char* layout,
+                     uint16_t val_len, size_t size, const Inserter& insert) const {
+    const table&               t = *current_;
+    if(overflow_)
+      throw std::runtime_error(err::msg() << "The " << layout << " layout does not support an overflow table");
+    std::unique_ptr<mer_array> ary;
+    for( ; true; size *= 2) {
+      ary.reset(new mer_array(size, t.keys.key_len(), val_len, t.keys.max_reprobe(), t.keys.reprobes()));
+      database_builder<Inserter> builder(t.keys, t.vals, *ary, insert, nb_threads);
+      builder.exec_join(nb_threads);
+      if(!builder.full())
+        break;
+    }
+
+    if(header) {
+      header->set_format();
+      header->layout(layout);
+      header->update_from_ary(*ary);
+      header->bits(t.vals.bits() - 1);
+      header->key_bytes(ary->size_bytes());
+      header->value_bytes(0);
+      header->write(os);
+    }
+    ary->write(os);
+  }
+
+  // The overflow table as a hot_table, serialized. Empty if there is
+  // none.
+  std::string overflow_data() const {
+    if(!overflow_)
+      return std::string();
+    const table& o        = *overflow_->current_;
+    size_t       nb_large = 0;
+    {
+      auto it = o.keys.eager_slice(0, 1);
+      while(it.next())
+        nb_large += o.vals[it.id()] >= 2;
+    }
+    hot_table large(nb_large);
+    {
+      auto it = o.keys.eager_slice(0, 1);
+      while(it.next()) {
+        const uint64_t v = o.vals[it.id()];
+        if(v >= 2)
+          large.insert(it.key(), v);
       }
-      size_thid_ = 0;
     }
-    size_barrier_.wait();
-    mer_array* new_keys = *(mer_array* volatile *)&new_keys_;
-    val_array* new_vals = *(val_array* volatile *)&new_vals_;
-    if(!new_keys || !new_vals) {
-      size_barrier_.wait();
-      return FULL;
+    vlog << "Overflow table of " << nb_large << " k-mers";
+    std::ostringstream os;
+    large.write(os);
+    return os.str();
+  }
+
+  thread_record& record() {
+    void* rec = pthread_getspecific(record_key_);
+    if(__builtin_expect(rec != 0, 1))
+      return *(thread_record*)rec;
+    const uint32_t i = __sync_fetch_and_add(&nb_records_, 1);
+    if(i >= records_.size())
+      throw std::runtime_error(err::msg() << "More than " << records_.size() << " threads adding to the hash");
+    records_[i].epoch = 0;
+    pthread_setspecific(record_key_, &records_[i]);
+    return records_[i];
+  }
+  static void enter(thread_record& rec) {
+    rec.epoch += 1;
+    __sync_synchronize();
+  }
+  static void exit(thread_record& rec) {
+    __sync_synchronize();
+    rec.epoch += 1;
+  }
+
+  // Wait for all the threads inside add() to leave it, then free the
+  // table. Must be called outside of add().
+  void reclaim(table* t) {
+    const uint32_t nb = std::min((size_t)nb_records_, records_.size());
+    for(uint32_t i = 0; i < nb; ++i) {
+      const uint64_t epoch = records_[i].epoch;
+      if(epoch & 1) {
+        while(records_[i].epoch == epoch)
+          sched_yield();
+      }
+    }
+    delete t;
+  }
+
+  // Count the entries of a table kept by compact(), or, if to is not
+  // null, add them to it. Each thread does one slice of the table.
+  class compactor : public jellyfish::thread_exec {
+    hash_with_quality&  hash_;
+    const table&        from_;
+    table* const        to_;
+    const uint64_t*     min_count_;
+    const int           nb_threads_;
+    std::vector<size_t> kept_;
+    volatile bool       full_;
+
+  public:
+    compactor(hash_with_quality& hash, const table& from, table* to, const uint64_t min_count[2], int nb_threads) :
+      hash_(hash), from_(from), to_(to), min_count_(min_count), nb_threads_(nb_threads), kept_(nb_threads, 0),
+      full_(false)
+    { }
+
+    virtual void start(int thid) {
+      size_t kept = 0;
+      auto   it   = from_.keys.eager_slice(thid, nb_threads_);
+      while(it.next() && !full_) {
+        const uint64_t v = from_.vals[it.id()];
+        if(v < 2 || (!hash_.escaped(v) && (v >> 1) < min_count_[v & 1]))
+          continue;
+        ++kept;
+        if(to_ && hash_.add_to(*to_, it.key(), v, false, hash_.escaped(v)) != OK)
+          full_ = true;
+      }
+      kept_[thid] = kept;
     }
 
-    uint16_t thid = (size_thid_ += 1) - 1;
-    auto it = keys_->eager_slice(thid, nb_threads_);
+    size_t kept() const { return std::accumulate(kept_.cbegin(), kept_.cend(), (size_t)0); }
+    bool full() const { return full_; }
+  };
+
+  // Add an entry with add_to() in the current table, growing it when
+  // full, and retrying when it was migrated.
+  status add_entry(thread_record& rec, const mer_dna& key, uint64_t v, bool first_sighting, bool in_overflow) {
+    while(true) {
+      enter(rec);
+      table* const t       = current_;
+      table* const retired = migrate_slice(t);
+      status       st      = full_ ? FULL : add_to(*t, key, v, first_sighting, in_overflow);
+      if(st == FULL)
+        st = grow(t);
+      exit(rec);
+      if(retired)
+        reclaim(retired);
+      if(st != RETRY)
+        return st;
+    }
+  }
 
+  // Entry of the value array whose value is in the overflow table
+  bool escaped(uint64_t v) const { return escape_ && (v >> 1) == escape_; }
+  status add_overflow(const mer_dna& key, uint64_t v) {
+    return v < 2 || overflow_->add_val(key, v) ? OK : FULL;
+  }
+
+  // Merge the value v into the entry for key in t. If
+  // first_sighting, count a low quality k-mer once more when it is new
+  // in t (see prefiltered()). A value too large for the value array
+  // goes to the overflow table, and the entry is escaped. If
+  // in_overflow, v is an escaped entry of an older table: the value of
+  // key is already in the overflow table.
+  status add_to(table& t, const mer_dna& key, uint64_t v, bool first_sighting = false, bool in_overflow = false) {
     bool   is_new;
     size_t id;
+    if(!t.keys.set(key, &is_new, &id))
+      return FULL;
+    if(first_sighting && is_new && !(v & 1))
+      v = merge_vals(v, 1 << 1, max_val_);
+
+    auto     entry = t.vals[id];
+    uint64_t nval  = entry.get();
+    while(true) {
+      if(nval == moved)
+        return RETRY;
+      if(escaped(nval))
+        return in_overflow ? OK : add_overflow(key, v);
+      uint64_t mval = nval; // Value moved to the overflow table
+      if(!in_overflow) {
+        mval = merge_vals(nval, v, max_val_);
+        if(mval == nval)
+          return OK;
+        if(!escape_ || (mval >> 1) < escape_) {
+          nval = mval;
+          if(__builtin_expect(entry.set(nval), 1))
+            return OK;
+          continue;
+        }
+      }
+      // Escape the entry, then move its value to the overflow table
+      uint64_t eval = escape_ << 1;
+      if(entry.set(eval))
+        return add_overflow(key, mval);
+      nval = eval;
+    }
+  }
+
+  // Migrate one slice of the table being migrated into t, if
+  // any. Return the old table if it is now entirely migrated. The
+  // caller must reclaim it.
+  table* migrate_slice(table* t) {
+    table* const from = t->prev;
+    if(__builtin_expect(from == 0, 1))
+      return 0;
+    const size_t slice = __sync_fetch_and_add(&t->next_slice, 1);
+    if(slice >= t->nb_slices)
+      return 0;
+
+    // Replace every value in the slice by 'moved', including for empty
+    // slots: a late inserter of a new key in the slice must retry in t.
+    const size_t          start = slice * t->slice_len;
+    std::vector<uint64_t> vals(t->slice_len);
+    for(size_t i = 0; i < t->slice_len; ++i) {
+      auto     entry = from->vals[start + i];
+      uint64_t v     = entry.get();
+      uint64_t nval  = moved;
+      while(!entry.set(nval)) {
+        v    = nval;
+        nval = moved;
+      }
+      vals[i] = v;
+    }
+
+    size_t nb_evicted = 0;
+    auto   it         = from->keys.eager_slice(slice, t->nb_slices);
     while(it.next()) {
-      new_keys->set(it.key(), &is_new, &id);
-      auto entry = (*new_vals)[id];
-      entry.get();
-      uint64_t ov = (*vals_)[it.id()].get();
-      entry.set(ov);
+      const uint64_t v = vals[it.id() - start];
+      if(v <= moved)
+        continue;
+      if(t->evict && v == singleton && !escaped(v)) {
+        ++nb_evicted;
+        continue;
+      }
+      if(add_to(*t, it.key(), v, false, escaped(v)) != OK) {
+        // t was filled by new k-mers during the migration. It can't
+        // grow until the migration is done, so set the entry aside.
+        t->overflow_mutex.lock();
+        t->overflow.push_back(std::make_pair(it.key(), v));
+        t->overflow_mutex.unlock();
+      }
+    }
+
+    if(nb_evicted)
+      __sync_fetch_and_add(&t->evicted, nb_evicted);
+    if(__sync_add_and_fetch(&t->done_slices, 1) == t->nb_slices) {
+      if(t->evict) {
+        __sync_fetch_and_add(&evicted_, t->evicted);
+        vlog << "Evicted " << t->evicted << " low quality singletons from the full hash";
+      }
+      t->prev = 0;
+      return from;
+    }
+    return 0;
+  }
+
+  // Allocate a table, in a new file if building in place
+  table* new_table(size_t size, uint16_t key_len, int val_bits, uint16_t reprobe_limit, const size_t* reprobes,
+                   table* from) {
+    std::ostringstream path;
+    if(!path_.empty())
+      path << path_ << ".tmp" << generation_++;
+    return new table(size, key_len, val_bits, reprobe_limit, reprobes, random_matrix(size, key_len),
+                     path.str(), header_, from);
+  }
+
+  // How to make room in the full table t. Without a memory bound,
+  // double it. Otherwise, evict the low quality singletons if a sample
+  // of the table has enough of them, else double it if it fits. A
+  // migration which frees only a few entries would be followed at once
+  // by another one: the table is full instead.
+  growth growth_of(const table& t) const {
+    if(!max_memory_)
+      return DOUBLE;
+    const size_t bytes     = t.key_bytes + t.val_bytes;
+    const size_t stride    = std::max((size_t)1, t.keys.size() / eviction_samples);
+    size_t       sampled   = 0;
+    size_t       evictable = 0;
+    for(size_t i = 0; i < t.keys.size(); i += stride, ++sampled) {
+      const uint64_t v = t.vals[i];
+      evictable       += v == singleton && !escaped(v);
+    }
+    if(evictable * min_evicted_frac >= sampled && 2 * bytes <= max_memory_)
+      return EVICT;
+    return 3 * bytes <= max_memory_ ? DOUBLE : NONE;
+  }
+
+  // Called from within add() when t is full. Allocate a new table,
+  // unless another thread did or the previous migration is not done.
+  status grow(table* t) {
+    if(full_)
+      return FULL;
+    if(current_ != t || t->prev != 0 || !__sync_bool_compare_and_swap(&resizing_, 0, 1))
+      return RETRY;
+    const growth g = current_ == t ? growth_of(*t) : NONE;
+    if(g == NONE && current_ == t) {
+      full_ = true;
+    } else if(g != NONE) {
+      try {
+        table* const nt = new_table(g == EVICT ? t->keys.size() : t->keys.size() * 2, t->keys.key_len(),
+                                    t->vals.bits(), t->keys.max_reprobe(), t->keys.reprobes(), t);
+        nt->evict       = g == EVICT;
+        for(auto it = t->overflow.cbegin(); it != t->overflow.cend(); ++it)
+          if(add_to(*nt, it->first, it->second, false, escaped(it->second)) != OK)
+            full_ = true;
+        __sync_synchronize();
+        current_ = nt;
+      } catch(...) {
+        full_ = true;
+      }
+    }
+    __sync_synchronize();
+    resizing_ = 0;
+    return full_ ? FULL : RETRY;
+  }
+};
+
+// Per thread cache in front of a hash_with_quality. The values of
+// the k-mers in the cache are merged locally with merge_vals, and
+// added to the hash when evicted or flushed. Frequent k-mers (repeats,
+// adapters) are then added to the shared table once in a while
+// instead of by every thread for every occurrence, which avoids the
+// contention on their entries. As merge_vals is associative and
+// commutative, the final content of the hash is the same.
+class hash_with_quality_cache {
+  hash_with_quality&    ary_;
+  const size_t          mask_;
+  std::vector<mer_dna>  keys_;
+  std::vector<uint64_t> vals_; // 0 if the slot is empty
+
+public:
+  hash_with_quality_cache(hash_with_quality& ary, unsigned int bits = 12) :
+    ary_(ary), mask_(((size_t)1 << bits) - 1),
+    keys_(mask_ + 1), vals_(mask_ + 1, 0)
+  { }
+
+  bool add(const mer_dna& key, unsigned int quality) {
+    const uint64_t v    = (1 << 1) | quality;
+    const size_t   slot = mix_bits(key.word(0)) & mask_;
+    uint64_t&      val  = vals_[slot];
+    if(val != 0 && keys_[slot] == key) {
+      val = hash_with_quality::merge_vals(val, v, ary_.max_val());
+      return true;
     }
-    size_barrier_.wait();
-    if(serial_thread) {
-      delete keys_;
-      delete vals_;
-      keys_ = new_keys;
-      vals_ = new_vals;
+    const bool res = val == 0 || ary_.add_val(keys_[slot], val);
+    keys_[slot] = key;
+    val         = v;
+    return res;
+  }
+
+  // Add the content of the cache to the hash and empty it
+  bool flush() {
+    bool res = true;
+    for(size_t i = 0; i <= mask_; ++i) {
+      if(vals_[i] != 0)
+        res = ary_.add_val(keys_[i], vals_[i]) && res;
+      vals_[i] = 0;
     }
-    size_barrier_.wait();
+    return res;
+  }
+};
 
-    return OK;
+// Add the entries of databases to a hash, each thread taking the same
+// slice of every database. The values are merged as by
+// hash_with_quality::add_val(): the high quality counts win, and the
+// counts of equal quality are summed, saturating at the maximum value
+// of the hash.
+class database_merger : public jellyfish::thread_exec {
+  const std::vector<const database_backend*>& dbs_;
+  hash_with_quality&                          ary_;
+  const int                                   nb_threads_;
+  volatile bool                               full_;
+
+public:
+  database_merger(const std::vector<const database_backend*>& dbs, hash_with_quality& ary, int nb_threads) :
+    dbs_(dbs), ary_(ary), nb_threads_(nb_threads), full_(false)
+  { }
+
+  virtual void start(int thid) {
+    for(auto it = dbs_.cbegin(); it != dbs_.cend() && !full_; ++it) {
+      std::unique_ptr<database_backend::cursor> c((*it)->new_slice_cursor(thid, nb_threads_));
+      while(!full_ && c->next()) {
+        const database_backend::value_type v = c->val();
+        if(v.first > 0 && !ary_.add_val(c->key(), (std::min(v.first, ary_.max_val()) << 1) | v.second))
+          full_ = true;
+      }
+    }
+    if(!ary_.done())
+      full_ = true;
+  }
+
+  bool full() const { return full_; }
+};
+
+// Load a file in memory with several threads, one chunk at a time:
+// read it into a buffer, or touch every page of a mapping of it to
+// fault the pages in.
+class parallel_file_loader : public jellyfish::thread_exec {
+  const int       fd_; // Read from fd_ if >= 0, touch the pages otherwise
+  char* const     base_;
+  const size_t    len_;
+  volatile size_t next_chunk_;
+  volatile bool   failed_;
+  volatile char   checksum_;
+
+  static const size_t chunk_size = 16 * 1024 * 1024;
+  static const size_t page_size  = 4096;
+
+  parallel_file_loader(int fd, char* base, size_t len) :
+    fd_(fd), base_(base), len_(len), next_chunk_(0), failed_(false), checksum_(0)
+  { }
+
+public:
+  virtual void start(int thid) {
+    char sum = 0;
+    while(!failed_) {
+      const size_t start = __sync_fetch_and_add(&next_chunk_, chunk_size);
+      if(start >= len_)
+        break;
+      const size_t end = std::min(len_, start + chunk_size);
+      if(fd_ >= 0) {
+        for(size_t off = start; off < end; ) {
+          const ssize_t s = pread(fd_, base_ + off, end - off, off);
+          if(s <= 0) {
+            if(s < 0 && errno == EINTR)
+              continue;
+            failed_ = true;
+            break;
+          }
+          off += s;
+        }
+      } else {
+        for(size_t off = start; off < end; off += page_size)
+          sum ^= base_[off];
+      }
+    }
+    checksum_ ^= sum; // So that the page touching is not optimized out
+  }
+
+  // Load len bytes at base with nb_threads threads and report the
+  // bandwidth. Return false if a read failed.
+  static bool load(int fd, char* base, size_t len, int nb_threads, const char* path) {
+    const auto           start = std::chrono::steady_clock::now();
+    parallel_file_loader loader(fd, base, len);
+    loader.exec_join(std::max(1, nb_threads));
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    vlog << (fd >= 0 ? "Read '" : "Faulted in '") << path << "': " << (len >> 20) << "MB in "
+         << secs << "s, " << (secs > 0 ? (len >> 20) / secs : 0) << "MB/s with " << nb_threads << " threads";
+    return !loader.failed_;
   }
 };
 
 class suck_in_file {
 public:
-  suck_in_file(const char* path) : base_(0) { read_in(path); }
-  suck_in_file(int fd) : base_(0) { read_in(fd); }
+  suck_in_file(const char* path, int nb_threads = 1) : base_(0) { read_in(path, nb_threads); }
+  suck_in_file(int fd, int nb_threads = 1) : base_(0) { read_in(fd, "<unknown>", nb_threads); }
   ~suck_in_file() { }
 
   char* base() const { return base_; }
   define_error_class(ErrorReading);
 
 protected:
-  void read_in(int fd, const char* path = "<unknown>") {
+  void read_in(int fd, const char* path, int nb_threads) {
     delete[] base_;
     struct stat buf;
     if(fstat(fd, &buf) < 0)
@@ -205,19 +1065,14 @@ protected:
     base_ = new (std::nothrow) char[buf.st_size];
     if(!base_)
       throw ErrorReading(err::msg() << "Not enough memory to read in file '" << path << "'" << err::no);
-    ssize_t sucked = 0;
-    while(sucked < buf.st_size) {
-      ssize_t s = read(fd, base_ + sucked, buf.st_size - sucked);
-      if(s == -1)
-        throw ErrorReading(err::msg() << "Failed to read in file '" << path << "'");
-      sucked += s;
-    }
+    if(!parallel_file_loader::load(fd, base_, buf.st_size, nb_threads, path))
+      throw ErrorReading(err::msg() << "Failed to read in file '" << path << "'");
   }
-  void read_in(const char* path) {
+  void read_in(const char* path, int nb_threads) {
     int fd = open(path, O_RDONLY);
     if(fd < 0)
       throw ErrorReading(err::msg() << "Can't open file '" << path << "'" << err::no);
-    read_in(fd, path);
+    read_in(fd, path, nb_threads);
     close(fd);
   }
 
@@ -225,71 +1080,612 @@ private:
   char* base_;
 };
 
+// A copy of a file in a named shared memory segment, for all the
+// processes of a node. The first process to open the segment creates
+// it and loads the file into it; the others wait until it is ready and
+// map it read-only. A name containing a '/' past its first character
+// is the path of a file in a hugetlbfs or tmpfs mount (relative to the
+// working directory if it does not start with a '/'), otherwise it is
+// a POSIX shared memory object. The segment stays after the processes exit, until it is removed (e.g.,
+// rm /dev/shm/<name>).
+class shared_segment {
+  struct control {
+    uint64_t          magic;
+    volatile uint64_t ready;
+    uint64_t          size;  // Size of the file
+    int64_t           mtime; // Modification time of the file
+    int64_t           creator;
+  };
+  static const uint64_t magic       = 0x314d48534d525551ULL; // "QURMSHM1"
+  static const size_t   data_offset = 4096;
+  static const size_t   alignment   = 2 * 1024 * 1024; // Huge page size
+
+  const bool        is_path_;
+  const std::string name_;
+  char*             base_;
+  size_t            len_;
+
+  static bool is_path(const std::string& name) { return name.find('/', 1) != std::string::npos; }
+  // POSIX shared memory names start with a '/', paths are absolute
+  static std::string segment_name(const std::string& name) {
+    if(!is_path(name))
+      return name[0] == '/' ? name : "/" + name;
+    if(name[0] == '/')
+      return name;
+    char cwd[PATH_MAX];
+    if(!getcwd(cwd, sizeof(cwd)))
+      throw ErrorSegment(err::msg() << "Can't get the working directory for shared segment '" << name << "'" << err::no);
+    return std::string(cwd) + "/" + name;
+  }
+  int open_segment(int flags) const {
+    return is_path_ ? open(name_.c_str(), flags, 0644) : shm_open(name_.c_str(), flags, 0644);
+  }
+  void unlink_segment() const {
+    if(is_path_)
+      unlink(name_.c_str());
+    else
+      shm_unlink(name_.c_str());
+  }
+  static void pause() { usleep(1000); }
+
+public:
+  define_error_class(ErrorSegment);
+
+  shared_segment(const std::string& name, const char* path, int nb_threads) :
+    is_path_(is_path(name)),
+    name_(segment_name(name)),
+    base_(0), len_(0)
+  {
+    struct stat st;
+    if(stat(path, &st) < 0)
+      throw ErrorSegment(err::msg() << "Can't stat file '" << path << "'" << err::no);
+    len_ = (data_offset + st.st_size + alignment - 1) / alignment * alignment;
+
+    const auto start = std::chrono::steady_clock::now();
+    while(true) {
+      int fd = open_segment(O_RDWR | O_CREAT | O_EXCL);
+      if(fd >= 0) {
+        create(fd, path, st, nb_threads);
+        return;
+      }
+      if(errno != EEXIST)
+        throw ErrorSegment(err::msg() << "Can't create shared segment '" << name_ << "'" << err::no);
+      fd = open_segment(O_RDONLY);
+      if(fd < 0) {
+        if(errno == ENOENT) // Removed in between, try again
+          continue;
+        throw ErrorSegment(err::msg() << "Can't open shared segment '" << name_ << "'" << err::no);
+      }
+      if(attach(fd, path, st)) {
+        const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        vlog << "Attached to shared segment '" << name_ << "' in " << secs << "s";
+        return;
+      }
+    }
+  }
+
+  ~shared_segment() {
+    if(base_)
+      munmap(base_, len_);
+  }
+
+  char* base() const { return base_ + data_offset; }
+
+private:
+  void create(int fd, const char* path, const struct stat& st, int nb_threads) {
+    vlog << "Creating shared segment '" << name_ << "'";
+    void* mem = MAP_FAILED;
+    if(ftruncate(fd, len_) == 0)
+      mem = mmap(0, len_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED) {
+      unlink_segment();
+      throw ErrorSegment(err::msg() << "Can't allocate shared segment '" << name_ << "'" << err::no);
+    }
+    base_ = (char*)mem;
+    control* const c = (control*)base_;
+    c->size          = st.st_size;
+    c->mtime         = st.st_mtime;
+    c->creator       = getpid();
+    c->magic         = magic;
+
+    const int in = open(path, O_RDONLY);
+    if(in < 0 || !parallel_file_loader::load(in, base(), st.st_size, nb_threads, path)) {
+      if(in >= 0)
+        close(in);
+      unlink_segment();
+      throw ErrorSegment(err::msg() << "Failed to read file '" << path << "' into shared segment");
+    }
+    close(in);
+    __sync_synchronize();
+    c->ready = 1;
+  }
+
+  // Wait for the segment to be ready and map it. Return false if the
+  // process creating it died, in which case the segment is removed.
+  // Throw an error if it is not initialized in time, as its creator is
+  // then unknown.
+  bool attach(int fd, const char* path, const struct stat& st) {
+    struct stat sst;
+    for(int i = 0; fstat(fd, &sst) == 0 && (size_t)sst.st_size < len_; ++i) {
+      if(i == 10000) { // Not sized after 10s: the creator died
+        close(fd);
+        unlink_segment();
+        return false;
+      }
+      pause();
+    }
+    void* const mem = mmap(0, len_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+      throw ErrorSegment(err::msg() << "Can't map shared segment '" << name_ << "'" << err::no);
+    base_ = (char*)mem;
+    const control* const c = (const control*)base_;
+    for(int i = 0; !c->ready; ++i) {
+      if(c->magic == magic && kill(c->creator, 0) < 0 && errno == ESRCH) {
+        munmap(base_, len_);
+        base_ = 0;
+        unlink_segment();
+        return false;
+      }
+      if(c->magic != magic && i == 10000) { // Not initialized after 10s
+        munmap(base_, len_);
+        base_ = 0;
+        throw ErrorSegment(err::msg() << "Shared segment '" << name_
+                           << "' was not initialized, its creator may have died. Remove it.");
+      }
+      pause();
+    }
+    if(c->size != (uint64_t)st.st_size || c->mtime != (int64_t)st.st_mtime)
+      throw ErrorSegment(err::msg() << "Shared segment '" << name_ << "' holds a different version of '"
+                         << path << "'. Remove it.");
+    return true;
+  }
+};
+
+// How to load a database file
+struct load_options {
+  bool        no_map;     // Read the file instead of mapping it
+  int         nb_threads; // Number of threads loading the file
+  std::string shm;        // Shared segment to attach to, if not empty
+
+  load_options(bool no_map_ = false, int nb_threads_ = 1, const std::string& shm_ = "") :
+    no_map(no_map_), nb_threads(nb_threads_), shm(shm_) { }
+
+  // Options for the i-th shard of a sharded database
+  load_options shard(size_t i) const {
+    std::ostringstream name;
+    if(!shm.empty())
+      name << shm << "." << i;
+    return load_options(no_map, nb_threads, name.str());
+  }
+};
+
 class map_or_read_file {
   std::unique_ptr<const jellyfish::mapped_file> mapped;
   std::unique_ptr<const suck_in_file>           sucked;
+  std::unique_ptr<const shared_segment>         shared;
 
 public:
-  map_or_read_file(const char* filename, bool no_map) {
-    if(no_map) {
-      sucked.reset(new suck_in_file(filename));
-    } else {
-      mapped.reset(new jellyfish::mapped_file(filename));
-      vlog << "Mer database bogus checksum: " << (int)mapped->load();
-    }
+  // Read the file, or map it, with nb_threads threads to load it
+  map_or_read_file(const char* filename, bool no_map, int nb_threads = 1) {
+    load(filename, load_options(no_map, nb_threads));
+  }
+  map_or_read_file(const char* filename, const load_options& options) {
+    load(filename, options);
   }
 
   char* base() {
+    if(shared)
+      return shared->base();
     if(mapped)
       return mapped->base();
     else
       return sucked->base();
   }
+
+private:
+  void load(const char* filename, const load_options& options) {
+    const bool no_map     = options.no_map;
+    const int  nb_threads = options.nb_threads;
+    if(!options.shm.empty()) {
+      shared.reset(new shared_segment(options.shm, filename, nb_threads));
+    } else if(no_map) {
+      sucked.reset(new suck_in_file(filename, nb_threads));
+    } else {
+      mapped.reset(new jellyfish::mapped_file(filename));
+      mapped->will_need();
+      parallel_file_loader::load(-1, mapped->base(), mapped->length(), nb_threads, filename);
+    }
+  }
 };
 
 
-class database_query {
-  const database_header        header_;
-  map_or_read_file             file_;
-  const mer_array_raw          keys_;
-  const val_array_raw          vals_;
-
-  static database_header parse_header(const char* filename) {
-    std::ifstream file(filename);
-    if(!file.good())
-      throw std::runtime_error(err::msg() << "Can't open '" << filename << "' for reading");
-    database_header res;
-    if(!res.read(file))
-      throw std::runtime_error(err::msg() << "Can't parse header of file '" << filename << "'");
-    if(!res.check_format())
-      std::runtime_error(err::msg() << "Wrong type '" << res.format() << "' for file '" << filename << "'");
-    return res;
+inline database_header parse_database_header(const char* filename) {
+  std::ifstream file(filename);
+  if(!file.good())
+    throw std::runtime_error(err::msg() << "Can't open '" << filename << "' for reading");
+  database_header res;
+  if(!res.read(file))
+    throw std::runtime_error(err::msg() << "Can't parse header of file '" << filename << "'");
+  if(!res.check_format())
+    throw std::runtime_error(err::msg() << "Wrong type '" << res.format() << "' for file '" << filename << "'");
+  return res;
+}
+
+// Path of a file referenced by the database filename: relative to the
+// directory of filename unless absolute.
+inline std::string database_relative_path(const char* filename, const std::string& path) {
+  if(!path.empty() && path[0] == '/')
+    return path;
+  const char* slash = strrchr(filename, '/');
+  return (slash ? std::string(filename, slash + 1) : std::string()) + path;
+}
+
+// Backend for the layout of header. base is the content of the file
+// filename. options are used to load the shards of a sharded
+// database.
+inline database_backend* open_database_backend(const database_header& header, char* base,
+                                               const char* filename, const load_options& options);
+
+// A database split in shards by minimizer, as written by
+// quorum_create_database --partitions. Every k-mer with a given
+// minimizer is in the same shard, whose index is the minimizer modulo
+// the number of shards. The shards may have different sizes, hence
+// different hash matrices: the lookups are routed to the shard
+// backends instead of using the batch hash positions.
+class sharded_database : public database_backend {
+  struct shard {
+    const database_header                   header;
+    map_or_read_file                        file;
+    std::unique_ptr<const database_backend> backend;
+    shard(const char* path, const load_options& options) :
+      header(parse_database_header(path)),
+      file(path, options),
+      backend(open_database_backend(header, file.base(), path, options))
+    { }
+  };
+
+  std::vector<std::unique_ptr<shard> > shards_;
+  const minimizer                      minimizer_;
+
+  // Iterate over the shards one after the other, or over the same
+  // slice of each shard if nb_slices > 0
+  class chain_cursor : public cursor {
+    const sharded_database&  db_;
+    const bool               with_keys_;
+    const size_t             slice_, nb_slices_;
+    size_t                   i_;
+    std::unique_ptr<cursor>  cursor_;
+
+    cursor* shard_cursor(size_t i) const {
+      const database_backend& backend = *db_.shards_[i]->backend;
+      return nb_slices_ ? backend.new_slice_cursor(slice_, nb_slices_) : backend.new_cursor(with_keys_);
+    }
+  public:
+    chain_cursor(const sharded_database& db, bool with_keys, size_t slice = 0, size_t nb_slices = 0) :
+      db_(db), with_keys_(with_keys), slice_(slice), nb_slices_(nb_slices), i_(0),
+      cursor_(shard_cursor(0))
+    { }
+    virtual bool next() {
+      while(!cursor_->next()) {
+        if(++i_ >= db_.shards_.size())
+          return false;
+        cursor_.reset(shard_cursor(i_));
+      }
+      return true;
+    }
+    virtual const mer_dna& key() const { return cursor_->key(); }
+    virtual value_type val() const { return cursor_->val(); }
+  };
+
+public:
+  sharded_database(const database_header& header, const char* filename, const load_options& options) :
+    database_backend(header),
+    minimizer_(header.minimizer_len())
+  {
+    const std::vector<std::string> paths = header.shards();
+    if(paths.empty())
+      throw std::runtime_error(err::msg() << "No shard in sharded database '" << filename << "'");
+    for(auto it = paths.cbegin(); it != paths.cend(); ++it) {
+      const std::string path = database_relative_path(filename, *it);
+      shards_.push_back(std::unique_ptr<shard>(new shard(path.c_str(), options.shard(shards_.size()))));
+    }
+  }
+
+  const database_backend& shard_for(const mer_dna& m) const {
+    return *shards_[minimizer_(m) % shards_.size()]->backend;
+  }
+
+  virtual value_type get(const mer_dna& m) const { return shard_for(m).get(m); }
+
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    for(size_t i = 0; i < n; ++i)
+      vals[i] = get(mers[i]);
+  }
+
+  virtual cursor* new_cursor(bool with_keys) const { return new chain_cursor(*this, with_keys); }
+  virtual cursor* new_slice_cursor(size_t i, size_t nb_slices) const {
+    return new chain_cursor(*this, true, i, nb_slices);
+  }
+};
+
+// Wrapper around a backend which answers some of the lookups itself,
+// without probing the backend. In a batch, the data of the wrapper is
+// prefetched for all the mers, then the mers not answered are probed
+// in runs. Only for the layouts which use the default sibling
+// batches.
+class front_database : public database_backend {
+  std::unique_ptr<const database_backend> db_;
+
+protected:
+  // Prefetch the data to answer m, whose hash is h = mer_hash(m)
+  virtual void prefetch(uint64_t h) const = 0;
+  // Answer the lookup of m, whose hash is h, in v if possible
+  virtual bool answer(const mer_dna& m, uint64_t h, value_type& v) const = 0;
+
+  // Read the content of the file path, of the given format, into a
+  // T constructed from the stream and args
+  template<typename T, typename... Args>
+  static T read_file(const std::string& path, const char* format, Args... args) {
+    std::ifstream is(path.c_str());
+    if(!is.good())
+      throw std::runtime_error(err::msg() << "Can't open '" << path << "' for reading");
+    jellyfish::file_header header;
+    if(!header.read(is) || header.format() != format)
+      throw std::runtime_error(err::msg() << "Wrong type '" << header.format() << "' for file '" << path << "'");
+    return T(is, args...);
+  }
+
+public:
+  front_database(const database_header& header, std::unique_ptr<database_backend> db) :
+    database_backend(header), db_(std::move(db))
+  { }
+
+  virtual value_type get(const mer_dna& m) const {
+    value_type v;
+    return answer(m, mer_hash(m), v) ? v : db_->get(m);
+  }
+
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    bool answered[max_batch * 4];
+    for(size_t start = 0; start < n; start += max_batch * 4) {
+      const size_t len = std::min(n - start, max_batch * 4);
+      uint64_t     hashes[max_batch * 4];
+      for(size_t i = 0; i < len; ++i) {
+        hashes[i] = mer_hash(mers[start + i]);
+        prefetch(hashes[i]);
+      }
+      for(size_t i = 0; i < len; ++i)
+        answered[i] = answer(mers[start + i], hashes[i], vals[start + i]);
+      for(size_t i = 0; i < len; ) {
+        if(answered[i]) {
+          ++i;
+          continue;
+        }
+        size_t end = i + 1;
+        while(end < len && !answered[end])
+          ++end;
+        db_->probe_batch(mers + start + i, oids + start + i, vals + start + i, end - i);
+        i = end;
+      }
+    }
+  }
+
+  virtual cursor* new_cursor(bool with_keys) const { return db_->new_cursor(with_keys); }
+  virtual cursor* new_slice_cursor(size_t i, size_t nb_slices) const { return db_->new_slice_cursor(i, nb_slices); }
+};
+
+// A blocked Bloom filter of the k-mers of the database answers most of
+// the lookups of absent k-mers, like the substitutions tried by the
+// error correction, from one cache line instead of a probe sequence
+// in the table.
+class filtered_database : public front_database {
+  const bloom_filter filter_;
+
+protected:
+  virtual void prefetch(uint64_t h) const { filter_.prefetch_hash(h); }
+  virtual bool answer(const mer_dna& m, uint64_t h, value_type& v) const {
+    if(filter_.contains_hash(h))
+      return false;
+    v = value_type(0, 0);
+    return true;
   }
 
 public:
-  database_query(const char* filename, bool map = false) :
-  header_(parse_header(filename)),
-  file_(filename, map),
-  keys_(file_.base() + header_.offset(), header_.key_bytes(),
-        header_.size(), header_.key_len(), header_.val_len(),
-        header_.max_reprobe(), header_.matrix()),
-  vals_(file_.base() + header_.offset() + header_.key_bytes(), header_.value_bytes(),
-        header_.bits() + 1, header_.size())
+  static const char* format() { return "binary/quorum_filter"; }
+
+  filtered_database(const database_header& header, std::unique_ptr<database_backend> db, const std::string& path) :
+    front_database(header, std::move(db)), filter_(read_file<bloom_filter>(path, format()))
+  { }
+};
+
+// A small table of the most frequent k-mers, which fits in the last
+// level cache, answers the lookups of the solid k-mers, the most
+// common during the error correction.
+class hot_database : public front_database {
+  const hot_table table_;
+
+protected:
+  virtual void prefetch(uint64_t h) const { table_.prefetch_hash(h); }
+  virtual bool answer(const mer_dna& m, uint64_t h, value_type& v) const {
+    const uint64_t val = table_.find_hash(m, h);
+    if(!val)
+      return false;
+    v = decode(val);
+    return true;
+  }
+
+public:
+  static const char* format() { return "binary/quorum_hot"; }
+
+  hot_database(const database_header& header, std::unique_ptr<database_backend> db, const std::string& path) :
+    front_database(header, std::move(db)),
+    table_(read_file<hot_table>(path, format(), header.key_words()))
+  { }
+};
+
+inline database_backend* open_layout_backend(const database_header& header, char* base,
+                                             const char* filename, const load_options& options) {
+  const std::string layout = header.layout();
+  if(layout == "split")
+    return new split_database(header, base);
+  if(layout == "packed")
+    return new packed_database(header, base);
+  if(layout == "neighbor")
+    return new neighbor_database(header, base);
+  if(layout == "sharded")
+    return new sharded_database(header, filename, options);
+  if(layout == "mphf")
+    return new mphf_database(header, base);
+  if(layout == "cuckoo")
+    return new cuckoo_database(header, base);
+  if(layout == "sketch")
+    return new sketch_database(header, base);
+  throw std::runtime_error(err::msg() << "Unknown database layout '" << layout << "'");
+}
+
+// Path of the file name referenced by the database filename, if not
+// empty and the file exists. The files of the front databases are
+// written after the database: they may be missing, e.g. after a crash
+// during an in place construction.
+inline bool front_file(const char* filename, const std::string& name, std::string& path) {
+  if(name.empty())
+    return false;
+  path = database_relative_path(filename, name);
+  if(access(path.c_str(), R_OK) == 0)
+    return true;
+  vlog << "Missing file '" << path << "', not used";
+  return false;
+}
+
+inline database_backend* open_database_backend(const database_header& header, char* base,
+                                               const char* filename, const load_options& options) {
+  std::unique_ptr<database_backend> db(open_layout_backend(header, base, filename, options));
+  const std::string                 layout = header.layout();
+  if(layout != "split" && layout != "packed")
+    return db.release();
+  // The hot table is checked first, then the filter
+  std::string path;
+  if(front_file(filename, header.filter(), path))
+    db.reset(new filtered_database(header, std::move(db), path));
+  if(front_file(filename, header.hot(), path))
+    db.reset(new hot_database(header, std::move(db), path));
+  return db.release();
+}
+
+// Write the lookup filter of the database in the file path, with a
+// false positive rate of fpr, to the file named in its header.
+inline void write_lookup_filter(const char* path, double fpr) {
+  const database_header             header(parse_database_header(path));
+  map_or_read_file                  file(path, load_options());
+  std::unique_ptr<database_backend> db(open_layout_backend(header, file.base(), path, load_options()));
+  size_t                            nb_mers = 0;
+  {
+    std::unique_ptr<database_backend::cursor> c(db->new_cursor(false));
+    while(c->next())
+      ++nb_mers;
+  }
+  bloom_filter filter(nb_mers, fpr);
+  {
+    std::unique_ptr<database_backend::cursor> c(db->new_cursor(true));
+    while(c->next())
+      filter.insert(c->key());
+  }
+  vlog << "Lookup filter of " << nb_mers << " k-mers, memory usage:" << (filter.memory_usage() >> 20) << "MB";
+
+  const std::string filter_path = database_relative_path(path, header.filter());
+  std::ofstream     os(filter_path.c_str());
+  if(!os.good())
+    throw std::runtime_error(err::msg() << "Can't open lookup filter '" << filter_path << "' for writing");
+  jellyfish::file_header filter_header;
+  filter_header.fill_standard();
+  filter_header.format(filtered_database::format());
+  filter_header.write(os);
+  filter.write(os);
+  os.close();
+  if(os.fail())
+    throw std::runtime_error(err::msg() << "Failed to write lookup filter '" << filter_path << "'");
+}
+
+// Write the hot table of the database in the file path, with its (at
+// most) nb_mers most frequent k-mers, to the file named in its header.
+inline void write_hot_table(const char* path, size_t nb_mers) {
+  const database_header             header(parse_database_header(path));
+  map_or_read_file                  file(path, load_options());
+  std::unique_ptr<database_backend> db(open_layout_backend(header, file.base(), path, load_options()));
+
+  // Histogram of the counts, the last bin for all the larger counts
+  static const uint64_t max_bin = (uint64_t)1 << 16;
+  std::vector<uint64_t> histo(max_bin + 1, 0);
+  {
+    std::unique_ptr<database_backend::cursor> c(db->new_cursor(false));
+    while(c->next())
+      ++histo[std::min(c->val().first, max_bin)];
+  }
+  // Take the k-mers with a count above the threshold, and enough with
+  // a count equal to the threshold to get nb_mers.
+  uint64_t threshold = max_bin;
+  size_t   above     = 0;
+  for( ; threshold > 0 && above + histo[threshold] <= nb_mers; --threshold)
+    above += histo[threshold];
+  size_t       equal  = threshold > 0 ? nb_mers - above : 0;
+  const size_t nb_hot = above + equal;
+  hot_table    table(nb_hot);
+  {
+    std::unique_ptr<database_backend::cursor> c(db->new_cursor(true));
+    while(c->next()) {
+      const database_backend::value_type v     = c->val();
+      const uint64_t                     count = std::min(v.first, max_bin);
+      if(count < threshold)
+        continue;
+      if(count == threshold) {
+        if(equal == 0)
+          continue;
+        --equal;
+      }
+      table.insert(c->key(), (v.first << 1) | v.second);
+    }
+  }
+  vlog << "Hot table of " << nb_hot << " k-mers with a count of at least "
+       << threshold << ", memory usage:" << (table.memory_usage() >> 20) << "MB";
+
+  const std::string hot_path = database_relative_path(path, header.hot());
+  std::ofstream     os(hot_path.c_str());
+  if(!os.good())
+    throw std::runtime_error(err::msg() << "Can't open hot table '" << hot_path << "' for writing");
+  jellyfish::file_header hot_header;
+  hot_header.fill_standard();
+  hot_header.format(hot_database::format());
+  hot_header.write(os);
+  table.write(os);
+  os.close();
+  if(os.fail())
+    throw std::runtime_error(err::msg() << "Failed to write hot table '" << hot_path << "'");
+}
+
+class database_query {
+  const database_header                   header_;
+  map_or_read_file                        file_;
+  std::unique_ptr<const database_backend> backend_;
+
+public:
+  database_query(const char* filename, bool map = false, int nb_threads = 1) :
+  header_(parse_database_header(filename)),
+  file_(filename, map, nb_threads),
+  backend_(open_database_backend(header_, file_.base(), filename, load_options(map, nb_threads)))
+  { }
+  database_query(const char* filename, const load_options& options) :
+  header_(parse_database_header(filename)),
+  file_(filename, options),
+  backend_(open_database_backend(header_, file_.base(), filename, options))
   { }
 
   const database_header& header() const { return header_; }
-  const mer_array_raw& keys() const { return keys_; }
-  const val_array_raw& vals() const { return vals_; }
+  const database_backend& backend() const { return *backend_; }
 
   std::pair<uint64_t, int> operator[](const mer_dna& m) const {
-    std::pair<uint64_t, int> res = { 0, 0 };
-    size_t                   id  = 0;
-    if(keys_.get_key_id(m, &id)) {
-      uint64_t v = vals_[id];
-      res.first  = v >> 1;
-      res.second = v & 0x1;
-    }
-    return res;
+    return backend_->get(m);
   }
 
   // Get value of m in the high quality database
@@ -298,18 +1694,49 @@ public:
     return v.second ? v.first : 0;
   }
 
-  // Get all alternatives at the best level
+  // Look up mers[0..n) into vals[0..n), overlapping the cache misses
+  void get_batch(const mer_dna* mers, std::pair<uint64_t, int>* vals, size_t n) const {
+    backend_->get_batch(mers, vals, n);
+  }
+
+  typedef database_backend::sibling_batch sibling_batch;
+
+  // Add to batch the four substitutions of base 0 of m.
   template<typename mer_type>
-  int get_best_alternatives(mer_type& m, uint64_t counts[4], int& ucode, int& level) const {
-    mer_dna tmp_mer;
-    int     count = 0;
+  void add_alternatives(const mer_type& m, sibling_batch& batch) const {
+    // Base 0 of m is base 0 of the forward mer for a forward_mer, and
+    // base 0 of the reverse mer for a backward_mer. In the latter
+    // case, the substitution by b is the reverse mer with base 0 set
+    // to the complement of b.
+    batch.reversed[batch.size] = !mer_type::forward;
+    const mer_dna& fmer = to_mer_dna(m.kmer().fmer(), batch.x);
+    const mer_dna& rmer = to_mer_dna(m.kmer().rmer(), batch.y);
+    if(mer_type::forward)
+      backend_->add_siblings(fmer, rmer, batch);
+    else
+      backend_->add_siblings(rmer, fmer, batch);
+  }
+
+  // Look up all the substitutions in batch. vals[4 * i + b] is the
+  // value of the i-th mer with base 0 replaced by b.
+  void get_alternatives(const sibling_batch& batch, std::pair<uint64_t, int>* vals) const {
+    backend_->probe_siblings(batch, vals);
+    for(size_t i = 0; i < batch.size; ++i) {
+      if(batch.reversed[i]) {
+        std::swap(vals[4 * i], vals[4 * i + 3]);
+        std::swap(vals[4 * i + 1], vals[4 * i + 2]);
+      }
+    }
+  }
+
+  // Pick the alternatives at the best level given the values of the
+  // four substitutions.
+  static int best_alternatives(const std::pair<uint64_t, int> vals[4], uint64_t counts[4], int& ucode, int& level) {
+    int count = 0;
     memset(counts, '\0', sizeof(uint64_t) * 4);
     level = 0;
-    int ori_code = m.code(0);
-
     for(int i = 0; i < 4; ++i) {
-      m.replace(0, i);
-      auto v = operator[](m.canonical());
+      const auto& v = vals[i];
       if(v.first > 0) {
         if(v.second >= level) {
           if(v.second > level && count > 0) {
@@ -324,41 +1751,87 @@ public:
         }
       }
     }
-    m.replace(0, ori_code); // Reset m to original value
     return count;
   }
 
+  // Get all alternatives at the best level
+  template<typename mer_type>
+  int get_best_alternatives(const mer_type& m, uint64_t counts[4], int& ucode, int& level) const {
+    sibling_batch batch;
+    return get_best_alternatives(m, batch, counts, ucode, level);
+  }
+  // Same, with a batch to reuse
+  template<typename mer_type>
+  int get_best_alternatives(const mer_type& m, sibling_batch& batch, uint64_t counts[4], int& ucode,
+                            int& level) const {
+    std::pair<uint64_t, int> vals[4];
+    batch.clear();
+    add_alternatives(m, batch);
+    get_alternatives(batch, vals);
+    return best_alternatives(vals, counts, ucode, level);
+  }
+
+  // Get value of m in the high quality database, through a per thread
+  // cache
+  uint64_t get_val(const mer_dna& m, lookup_cache& cache) const {
+    std::pair<uint64_t, int> v;
+    if(!cache.get(m, lookup_cache::single, &v)) {
+      v = operator[](m);
+      cache.put(m, lookup_cache::single, &v);
+    }
+    return v.second ? v.first : 0;
+  }
+
+  // Get all alternatives at the best level, through a per thread
+  // cache. The cache holds the values of the substitutions of the
+  // base 0 of the forward mer for a forward_mer, of the reverse mer
+  // for a backward_mer.
+  template<typename mer_type>
+  int get_best_alternatives(const mer_type& m, sibling_batch& batch, lookup_cache& cache, uint64_t counts[4],
+                            int& ucode, int& level) const {
+    std::pair<uint64_t, int> vals[4];
+    const mer_dna&           x = mer_type::forward ? to_mer_dna(m.kmer().fmer(), batch.x) : to_mer_dna(m.kmer().rmer(), batch.y);
+    if(!cache.get(x, lookup_cache::siblings, vals)) {
+      batch.clear();
+      add_alternatives(m, batch);
+      backend_->probe_siblings(batch, vals);
+      cache.put(x, lookup_cache::siblings, vals);
+    }
+    if(!mer_type::forward) {
+      std::swap(vals[0], vals[3]);
+      std::swap(vals[1], vals[2]);
+    }
+    return best_alternatives(vals, counts, ucode, level);
+  }
+
+  // Iterate over the (k-mer, (count, quality)) entries. The iterator
+  // shares its state when copied.
   class const_iterator :
-    public std::iterator<std::forward_iterator_tag, std::pair<const mer_dna*, std::pair<uint64_t, int> > > {
-    mer_array_raw::const_iterator it_;
-    const val_array_raw&          vals_;
-    value_type                    content_;
+    public std::iterator<std::input_iterator_tag, std::pair<const mer_dna*, std::pair<uint64_t, int> > > {
+    std::shared_ptr<database_backend::cursor> cursor_;
+    value_type                                content_;
   public:
-    const_iterator(const mer_array_raw::const_iterator it, const val_array_raw& vals) :
-      it_(it), vals_(vals)
-    { }
+    const_iterator() { }
+    explicit const_iterator(database_backend::cursor* cursor) : cursor_(cursor) { ++*this; }
 
-    bool operator==(const const_iterator& rhs) const { return it_ == rhs.it_; }
-    bool operator!=(const const_iterator& rhs) const { return it_ != rhs.it_; }
-    const_iterator& operator++() { ++it_; return *this; }
-    const_iterator operator++(int) {
-      const_iterator res(*this);
-      ++*this;
-      return res;
+    bool operator==(const const_iterator& rhs) const { return cursor_ == rhs.cursor_; }
+    bool operator!=(const const_iterator& rhs) const { return cursor_ != rhs.cursor_; }
+    const_iterator& operator++() {
+      if(cursor_->next()) {
+        content_.first  = &cursor_->key();
+        content_.second = cursor_->val();
+      } else {
+        cursor_.reset();
+      }
+      return *this;
     }
 
-    const value_type& operator*() {
-      content_.first         = &it_.key();
-      uint64_t v             = vals_[it_.id()];
-      content_.second.first  = v >> 1;
-      content_.second.second = v & 0x1;
-      return content_;
-    }
-    const value_type* operator->() { return &this->operator*(); }
+    const value_type& operator*() { return content_; }
+    const value_type* operator->() { return &content_; }
   };
 
-  const_iterator begin() const { return const_iterator(keys_.begin(), vals_); }
-  const_iterator end() const { return const_iterator(keys_.end(), vals_); }
+  const_iterator begin() const { return const_iterator(backend_->new_cursor(true)); }
+  const_iterator end() const { return const_iterator(); }
 };
 
 #endif /* __QUORUM_MER_DATABASE_HPP__ */
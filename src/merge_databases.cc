@@ -0,0 +1,128 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <jellyfish/thread_exec.hpp>
+
+#include <src/mer_database.hpp>
+#include <src/hyperloglog.hpp>
+#include <src/verbose_log.hpp>
+#include <src/merge_databases_cmdline.hpp>
+
+typedef std::vector<const database_backend*> backend_vector;
+
+// Estimate the number of distinct k-mers in the union of the
+// databases. Each thread updates its own HyperLogLog sketch with a
+// slice of every database.
+class distinct_key_estimator : public jellyfish::thread_exec {
+  const backend_vector&    dbs_;
+  const int                nb_threads_;
+  std::vector<hyperloglog> sketches_;
+
+public:
+  distinct_key_estimator(const backend_vector& dbs, int nb_threads) :
+    dbs_(dbs), nb_threads_(nb_threads), sketches_(nb_threads)
+  { }
+
+  virtual void start(int thid) {
+    for(auto it = dbs_.cbegin(); it != dbs_.cend(); ++it) {
+      std::unique_ptr<database_backend::cursor> c((*it)->new_slice_cursor(thid, nb_threads_));
+      while(c->next())
+        sketches_[thid].add(c->key());
+    }
+  }
+
+  double estimate() const {
+    hyperloglog res(sketches_.front());
+    for(auto it = sketches_.cbegin() + 1; it < sketches_.cend(); ++it)
+      res.merge(*it);
+    return res.estimate();
+  }
+
+  double error() const { return sketches_.front().error(); }
+};
+
+// Load factor targeted when the size is estimated from the inputs
+static const double estimated_load_factor = 0.8;
+
+int main(int argc, char *argv[])
+{
+  merge_databases_cmdline args(argc, argv);
+  verbose_log::verbose = args.verbose_flag;
+
+  // Check the headers first: the layouts of the databases need k to
+  // be set before they are opened.
+  unsigned int bits = 0;
+  for(auto it = args.dbs_arg.cbegin(); it != args.dbs_arg.cend(); ++it) {
+    const database_header header = parse_database_header(*it);
+    if(header.layout() == "mphf" || header.layout() == "sketch")
+      merge_databases_cmdline::error() << "The " << header.layout() << " layout of '" << *it
+                                       << "' does not store the k-mers";
+    if(it == args.dbs_arg.cbegin())
+      mer_dna::k(header.key_len() / 2);
+    else if(header.key_len() != 2 * mer_dna::k())
+      merge_databases_cmdline::error() << "The k-mers of '" << *it << "' have length " << (header.key_len() / 2)
+                                       << " instead of " << mer_dna::k();
+    bits = std::max(bits, header.bits());
+  }
+
+  std::vector<std::unique_ptr<database_query> > inputs;
+  backend_vector                                dbs;
+  for(auto it = args.dbs_arg.cbegin(); it != args.dbs_arg.cend(); ++it) {
+    inputs.push_back(std::unique_ptr<database_query>(new database_query(*it, load_options(false, args.threads_arg))));
+    dbs.push_back(&inputs.back()->backend());
+  }
+  if(args.bits_given)
+    bits = args.bits_arg;
+  if(bits < 1 || bits > 63)
+    merge_databases_cmdline::error("The number of bits should be between 1 and 63");
+
+  size_t size = args.size_arg;
+  if(!args.size_given) {
+    vlog << "Estimating number of distinct k-mers";
+    distinct_key_estimator estimator(dbs, args.threads_arg);
+    estimator.exec_join(args.threads_arg);
+    const double distinct = estimator.estimate();
+    // Add 3 standard errors to the estimate to be safe
+    size = std::max((size_t)1, (size_t)(distinct * (1 + 3 * estimator.error()) / estimated_load_factor));
+    vlog << "Estimated distinct k-mers:" << (uint64_t)distinct << " hash size:" << size;
+  }
+
+  std::ofstream output(args.output_arg);
+  if(!output.good())
+    merge_databases_cmdline::error() << "Failed to open output file '" << args.output_arg << "'";
+  database_header header;
+  header.fill_standard();
+  header.set_cmdline(argc, argv);
+
+  hash_with_quality ary(size, 2 * mer_dna::k(), bits, args.threads_arg);
+  database_merger   merger(dbs, ary, args.threads_arg);
+  merger.exec_join(args.threads_arg);
+  if(merger.full())
+    merge_databases_cmdline::error("Hash is full");
+  ary.write(output, &header);
+  output.close();
+  if(!output.good())
+    merge_databases_cmdline::error() << "Error while writing database '" << args.output_arg << "'";
+  vlog << "Merged " << dbs.size() << " databases";
+
+  return 0;
+}
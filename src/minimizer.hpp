@@ -0,0 +1,97 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_MINIMIZER_HPP__
+#define __QUORUM_MINIMIZER_HPP__
+
+#include <stdint.h>
+#include <deque>
+#include <utility>
+#include <algorithm>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/hyperloglog.hpp>
+
+// The minimizer of a k-mer is the smallest hash of its canonical
+// m-mers. A k-mer and its reverse complement have the same minimizer,
+// and consecutive k-mers of a read often do too.
+class minimizer {
+  const unsigned int m_;
+  const uint64_t     mask_;
+
+public:
+  explicit minimizer(unsigned int m) :
+    m_(m), mask_((uint64_t)-1 >> (64 - 2 * m))
+  { }
+
+  unsigned int m() const { return m_; }
+
+  // Roll the forward and reverse complement m-mers by one base
+  void roll(uint64_t& fwd, uint64_t& rc, int code) const {
+    fwd = ((fwd << 2) | code) & mask_;
+    rc  = (rc >> 2) | ((uint64_t)(3 - code) << (2 * m_ - 2));
+  }
+  static uint64_t hash(uint64_t fwd, uint64_t rc) { return mix_bits(std::min(fwd, rc)); }
+
+  // Minimizer of the k-mer m. m_ must be at most k.
+  uint64_t operator()(const jellyfish::mer_dna& m) const {
+    uint64_t fwd = 0, rc = 0, res = (uint64_t)-1;
+    for(unsigned int i = 0; i < jellyfish::mer_dna::k(); ++i) {
+      roll(fwd, rc, m.base(jellyfish::mer_dna::k() - 1 - i).code());
+      if(i + 1 >= m_)
+        res = std::min(res, hash(fwd, rc));
+    }
+    return res;
+  }
+};
+
+// Minimizer of the last k-mer of a sequence given one base at a time.
+class minimizer_window {
+  const minimizer&                           min_;
+  const unsigned int                         k_;
+  uint64_t                                   fwd_, rc_;
+  unsigned int                               len_; // Number of bases since last reset
+  std::deque<std::pair<unsigned int, uint64_t> > window_; // (position, hash), increasing hashes
+
+public:
+  minimizer_window(const minimizer& min, unsigned int k) :
+    min_(min), k_(k), fwd_(0), rc_(0), len_(0) { }
+
+  void reset() {
+    len_ = 0;
+    window_.clear();
+  }
+
+  // Add a base. Return true if there is a full k-mer
+  bool push(int code) {
+    min_.roll(fwd_, rc_, code);
+    if(++len_ < min_.m())
+      return false;
+    const uint64_t h = minimizer::hash(fwd_, rc_);
+    while(!window_.empty() && window_.back().second >= h)
+      window_.pop_back();
+    window_.push_back(std::make_pair(len_, h));
+    // The k-mer ending at len_ has m-mers ending in (len_ - k + m, len_]
+    while(window_.front().first + k_ <= len_ + min_.m() - 1)
+      window_.pop_front();
+    return len_ >= k_;
+  }
+
+  uint64_t value() const { return window_.front().second; }
+};
+
+#endif /* __QUORUM_MINIMIZER_HPP__ */
@@ -0,0 +1,349 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_MPHF_DATABASE_HPP__
+#define __QUORUM_MPHF_DATABASE_HPP__
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <algorithm>
+
+#include <jellyfish/err.hpp>
+#include <src/database_backend.hpp>
+#include <src/hyperloglog.hpp>
+#include <src/verbose_log.hpp>
+
+// Array of integers of width bits (at most 64) packed in 64 bit
+// words. The words are not owned.
+class packed_ints {
+  uint64_t* const    data_;
+  const unsigned int width_;
+  const uint64_t     mask_;
+
+public:
+  packed_ints(uint64_t* data, unsigned int width) :
+    data_(data), width_(width), mask_(width >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1)
+  { }
+
+  // Number of words to store n integers. One word of padding, so an
+  // integer can always be read as two words.
+  static size_t nb_words(size_t n, unsigned int width) { return (n * width + 63) / 64 + 1; }
+  uint64_t mask() const { return mask_; }
+
+  uint64_t get(size_t i) const {
+    const size_t       bit = i * width_;
+    const unsigned int off = bit % 64;
+    uint64_t           res = data_[bit / 64] >> off;
+    if(off + width_ > 64)
+      res |= data_[bit / 64 + 1] << (64 - off);
+    return res & mask_;
+  }
+
+  void set(size_t i, uint64_t v) {
+    const size_t       bit = i * width_;
+    const unsigned int off = bit % 64;
+    v &= mask_;
+    data_[bit / 64] = (data_[bit / 64] & ~(mask_ << off)) | (v << off);
+    if(off + width_ > 64)
+      data_[bit / 64 + 1] = (data_[bit / 64 + 1] & ~(mask_ >> (64 - off))) | (v >> (64 - off));
+  }
+};
+
+// Minimal perfect hash function over 64 bit hashes, as in BBHash: a
+// cascade of bit arrays. At each level, the hashes which fall alone
+// in their position set their bit, the others go to the next
+// level. The index of a hash is the rank of its bit in the
+// concatenation of the levels, so the n hashes of the set are mapped
+// to [0, n). A hash not in the set is mapped to some index in [0, n)
+// or to npos.
+//
+// Serialized form, in 64 bit words: the number of levels, the size in
+// bits of each level, the number of words of the bit arrays, the bit
+// arrays and the rank samples (number of bits set before every block
+// of 8 words).
+class mphf {
+  static const unsigned int max_levels   = 40;
+  static const unsigned int sample_words = 8;
+
+  const uint64_t* sizes_;
+  unsigned int    nb_levels_;
+  const uint64_t* bits_;
+  const uint64_t* ranks_;
+  size_t          nb_words_;
+
+  static uint64_t position(uint64_t h, unsigned int level, uint64_t size) {
+    return mix_bits(h + (level + 1) * 0x9e3779b97f4a7c15ULL) % size;
+  }
+
+  size_t rank(uint64_t p) const {
+    const size_t w   = p / 64;
+    size_t       res = ranks_[w / sample_words];
+    for(size_t i = w - w % sample_words; i < w; ++i)
+      res += __builtin_popcountll(bits_[i]);
+    return res + __builtin_popcountll(bits_[w] & (((uint64_t)1 << (p % 64)) - 1));
+  }
+
+public:
+  static const size_t npos = (size_t)-1;
+
+  explicit mphf(const uint64_t* data) :
+    sizes_(data + 1), nb_levels_(data[0]),
+    bits_(data + 2 + nb_levels_), ranks_(bits_ + data[1 + nb_levels_]),
+    nb_words_(data[1 + nb_levels_])
+  { }
+
+  // Number of words of the serialized form
+  size_t serialized_words() const { return 2 + nb_levels_ + nb_words_ + nb_words_ / sample_words + 1; }
+
+  size_t operator()(uint64_t h) const {
+    uint64_t offset = 0;
+    for(unsigned int l = 0; l < nb_levels_; ++l) {
+      const uint64_t p = offset + position(h, l, sizes_[l]);
+      if((bits_[p / 64] >> (p % 64)) & 1)
+        return rank(p);
+      offset += sizes_[l];
+    }
+    return npos;
+  }
+
+  // Most of the hashes are found at level 0
+  void prefetch(uint64_t h) const {
+    if(nb_levels_ > 0)
+      __builtin_prefetch(bits_ + position(h, 0, sizes_[0]) / 64);
+  }
+
+  // Build the function for the distinct elements of hashes, with
+  // gamma bits per element and per level. The hashes which could not
+  // be placed, e.g. equal hashes of different elements, are left in
+  // hashes.
+  static std::vector<uint64_t> build(std::vector<uint64_t>& hashes, double gamma) {
+    std::vector<uint64_t> sizes, bits;
+    for(unsigned int l = 0; !hashes.empty() && l < max_levels; ++l) {
+      const uint64_t        size = std::max((uint64_t)64, ((uint64_t)(gamma * hashes.size()) + 63) & ~(uint64_t)63);
+      std::vector<uint64_t> seen(size / 64, 0), collide(size / 64, 0);
+      for(auto it = hashes.cbegin(); it != hashes.cend(); ++it) {
+        const uint64_t p    = position(*it, l, size);
+        const uint64_t mask = (uint64_t)1 << (p % 64);
+        if(seen[p / 64] & mask)
+          collide[p / 64] |= mask;
+        seen[p / 64] |= mask;
+      }
+      size_t left = 0;
+      for(auto it = hashes.cbegin(); it != hashes.cend(); ++it) {
+        const uint64_t p = position(*it, l, size);
+        if((collide[p / 64] >> (p % 64)) & 1)
+          hashes[left++] = *it;
+      }
+      hashes.resize(left);
+      for(size_t i = 0; i < seen.size(); ++i)
+        bits.push_back(seen[i] & ~collide[i]);
+      sizes.push_back(size);
+    }
+
+    std::vector<uint64_t> res;
+    res.push_back(sizes.size());
+    res.insert(res.end(), sizes.begin(), sizes.end());
+    res.push_back(bits.size());
+    res.insert(res.end(), bits.begin(), bits.end());
+    size_t rank = 0;
+    for(size_t i = 0; i < bits.size(); ++i) {
+      if(i % sample_words == 0)
+        res.push_back(rank);
+      rank += __builtin_popcountll(bits[i]);
+    }
+    if(bits.size() % sample_words == 0)
+      res.push_back(rank);
+    return res;
+  }
+};
+
+// Compact read-only layout "mphf": the k-mers are not stored. A
+// minimal perfect hash function maps each k-mer to an index, where are
+// stored a fingerprint of the k-mer and its value, bit packed. A
+// k-mer absent from the database is reported present with a
+// probability of 2^-fingerprint_bits. With k <= 32 and 64 bit
+// fingerprints, the fingerprint is a bijection of the k-mer and the
+// lookups are exact.
+//
+// The few k-mers the function could not place are stored in full
+// after the values, and searched linearly.
+//
+// Data, in 64 bit words: the function, the fingerprints, the values,
+// the number of extra k-mers and the extra k-mers (the words of the
+// k-mer followed by the value).
+class mphf_database : public database_backend {
+  static const uint64_t fingerprint_seed = 0x5bd1e9955bd1e995ULL;
+
+  const size_t      nb_keys_;
+  const mphf        function_;
+  const packed_ints fingerprints_;
+  const packed_ints vals_;
+  const uint64_t*   extra_;
+  const size_t      nb_extra_;
+
+  // Iterate over the values: the k-mers are not stored
+  class val_cursor : public cursor {
+    const mphf_database& db_;
+    size_t               i_;
+    uint64_t             val_;
+  public:
+    val_cursor(const mphf_database& db) : db_(db), i_(0), val_(0) { }
+    virtual bool next() {
+      if(i_ >= db_.nb_keys_ + db_.nb_extra_)
+        return false;
+      val_ = i_ < db_.nb_keys_ ? db_.vals_.get(i_) : db_.extra_val(i_ - db_.nb_keys_);
+      ++i_;
+      return true;
+    }
+    virtual const mer_dna& key() const { throw std::logic_error("Cursor created without keys"); }
+    virtual value_type val() const { return decode(val_); }
+  };
+
+  static size_t entry_words() { return mer_dna::nb_words() + 1; }
+  uint64_t extra_val(size_t i) const { return extra_[i * entry_words() + mer_dna::nb_words()]; }
+
+  value_type get_extra(const mer_dna& m) const {
+    for(size_t i = 0; i < nb_extra_; ++i) {
+      const uint64_t* const entry = extra_ + i * entry_words();
+      unsigned int          w     = 0;
+      while(w < mer_dna::nb_words() && entry[w] == m.word(w))
+        ++w;
+      if(w == mer_dna::nb_words())
+        return decode(extra_val(i));
+    }
+    return value_type(0, 0);
+  }
+
+  value_type get_hash(const mer_dna& m, uint64_t h) const {
+    const size_t i = function_(h);
+    if(i == mphf::npos)
+      return get_extra(m);
+    return fingerprints_.get(i) == (fingerprint(m) & fingerprints_.mask()) ? decode(vals_.get(i)) : value_type(0, 0);
+  }
+
+public:
+  mphf_database(const database_header& header, char* base) :
+    database_backend(header),
+    nb_keys_(header.nb_keys()),
+    function_((const uint64_t*)(base + header.offset())),
+    fingerprints_((uint64_t*)(base + header.offset()) + function_.serialized_words(), header.fingerprint_bits()),
+    vals_((uint64_t*)(base + header.offset()) + function_.serialized_words()
+          + packed_ints::nb_words(nb_keys_, header.fingerprint_bits()),
+          header.bits() + 1),
+    extra_((const uint64_t*)(base + header.offset()) + function_.serialized_words()
+           + packed_ints::nb_words(nb_keys_, header.fingerprint_bits())
+           + packed_ints::nb_words(nb_keys_, header.bits() + 1) + 1),
+    nb_extra_(extra_[-1])
+  { }
+
+  static uint64_t fingerprint(const mer_dna& m) { return mer_hash(m, fingerprint_seed); }
+
+  virtual value_type get(const mer_dna& m) const { return get_hash(m, mer_hash(m)); }
+
+  virtual cursor* new_cursor(bool with_keys) const {
+    if(with_keys)
+      throw std::runtime_error("The mphf database layout does not store the k-mers");
+    return new val_cursor(*this);
+  }
+
+  // The hash positions are those of the original database: ignore
+  // them and prefetch level 0 of the function instead.
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    uint64_t hashes[max_batch * 4];
+    for(size_t start = 0; start < n; start += max_batch * 4) {
+      const size_t len = std::min(n - start, max_batch * 4);
+      for(size_t i = 0; i < len; ++i) {
+        hashes[i] = mer_hash(mers[start + i]);
+        function_.prefetch(hashes[i]);
+      }
+      for(size_t i = 0; i < len; ++i)
+        vals[start + i] = get_hash(mers[start + i], hashes[i]);
+    }
+  }
+};
+
+// Write the content of db, with keys of key_len bits and values of
+// bits bits, in the mphf layout. header is filled and written before
+// the data. The function takes about 3.7 bits per k-mer with gamma =
+// 2: gamma * e^(1/gamma) = 3.3 bits for the bit arrays, plus 1/8 of
+// that for the rank samples (less memory but a slower build with a
+// smaller gamma). The fingerprints have fingerprint_bits bits (1 to
+// 64).
+inline void write_mphf_database(const database_backend& db, unsigned int key_len, unsigned int bits,
+                                std::ostream& os, database_header& header,
+                                unsigned int fingerprint_bits = 32, double gamma = 2.0) {
+  if(fingerprint_bits < 1 || fingerprint_bits > 64)
+    throw std::runtime_error(jellyfish::err::msg() << "Invalid fingerprint length " << fingerprint_bits);
+
+  std::vector<uint64_t> hashes;
+  {
+    std::unique_ptr<database_backend::cursor> c(db.new_cursor(true));
+    while(c->next())
+      hashes.push_back(mer_hash(c->key()));
+  }
+  const size_t          nb_mers  = hashes.size();
+  std::vector<uint64_t> function = mphf::build(hashes, gamma);
+  const mphf            f(function.data());
+  const size_t          nb_keys  = nb_mers - hashes.size();
+  vlog << "Minimal perfect hash of " << nb_mers << " k-mers: " << (function.size() * 64.0 / nb_mers)
+       << " bits per k-mer, " << hashes.size() << " k-mers not placed";
+
+  std::vector<uint64_t> fingerprint_words(packed_ints::nb_words(nb_keys, fingerprint_bits), 0);
+  std::vector<uint64_t> val_words(packed_ints::nb_words(nb_keys, bits + 1), 0);
+  std::vector<uint64_t> extra;
+  packed_ints           fingerprints(fingerprint_words.data(), fingerprint_bits);
+  packed_ints           vals(val_words.data(), bits + 1);
+  {
+    std::unique_ptr<database_backend::cursor> c(db.new_cursor(true));
+    while(c->next()) {
+      const mer_dna&                     m   = c->key();
+      const database_backend::value_type v   = c->val();
+      const uint64_t                     val = (v.first << 1) | v.second;
+      const size_t                       i   = f(mer_hash(m));
+      if(i == mphf::npos) {
+        for(unsigned int w = 0; w < mer_dna::nb_words(); ++w)
+          extra.push_back(m.word(w));
+        extra.push_back(val);
+      } else {
+        fingerprints.set(i, mphf_database::fingerprint(m));
+        vals.set(i, val);
+      }
+    }
+  }
+
+  header.set_format();
+  header.layout("mphf");
+  header.key_len(key_len);
+  header.bits(bits);
+  header.nb_keys(nb_keys);
+  header.fingerprint_bits(fingerprint_bits);
+  header.matrix(db.matrix());
+  header.size(db.size_mask() + 1);
+  header.write(os);
+
+  const uint64_t nb_extra = extra.size() / (mer_dna::nb_words() + 1);
+  os.write((const char*)function.data(), function.size() * sizeof(uint64_t));
+  os.write((const char*)fingerprint_words.data(), fingerprint_words.size() * sizeof(uint64_t));
+  os.write((const char*)val_words.data(), val_words.size() * sizeof(uint64_t));
+  os.write((const char*)&nb_extra, sizeof(nb_extra));
+  os.write((const char*)extra.data(), extra.size() * sizeof(uint64_t));
+}
+
+#endif /* __QUORUM_MPHF_DATABASE_HPP__ */
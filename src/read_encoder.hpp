@@ -0,0 +1,127 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_READ_ENCODER_HPP__
+#define __QUORUM_READ_ENCODER_HPP__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define QUORUM_HAVE_AVX2_TARGET 1
+#endif
+
+// Encoding of a read, one byte per base: the 2 bit code of the base
+// (A=0, C=1, G=2, T=3), read_encoding::high if the quality is at
+// least the threshold, or read_encoding::not_dna if the base is not
+// one of ACGT (any case).
+//
+// The code of an ACGT character c is ((c >> 1) ^ (c >> 2)) & 3, for
+// upper and lower case alike. So a read is encoded without a table
+// lookup, 16 or 32 bases at a time with SSE2 or AVX2.
+namespace read_encoding {
+static const uint8_t code_mask = 0x3;
+static const uint8_t high      = 0x4;
+static const uint8_t not_dna   = 0x80;
+
+inline uint8_t encode_base(char c, char q, char qual_thresh) {
+  const char l = c | 0x20;
+  if(l != 'a' && l != 'c' && l != 'g' && l != 't')
+    return not_dna;
+  return (((c >> 1) ^ (c >> 2)) & code_mask) | (q >= qual_thresh ? high : 0);
+}
+
+inline void encode_scalar(const char* seq, const char* qual, size_t len, char qual_thresh, uint8_t* res) {
+  for(size_t i = 0; i < len; ++i)
+    res[i] = encode_base(seq[i], qual[i], qual_thresh);
+}
+
+#ifdef __SSE2__
+inline void encode_sse2(const char* seq, const char* qual, size_t len, char qual_thresh, uint8_t* res) {
+  const __m128i lower = _mm_set1_epi8(0x20);
+  const __m128i a = _mm_set1_epi8('a'), c = _mm_set1_epi8('c'), g = _mm_set1_epi8('g'), t = _mm_set1_epi8('t');
+  const __m128i mask  = _mm_set1_epi8(code_mask);
+  const __m128i hi    = _mm_set1_epi8(high);
+  const __m128i nd    = _mm_set1_epi8((char)not_dna);
+  const __m128i thres = _mm_set1_epi8(qual_thresh - 1); // Quality chars are positive: q >= t iff q > t - 1
+  size_t i = 0;
+  for( ; i + 16 <= len; i += 16) {
+    const __m128i s    = _mm_loadu_si128((const __m128i*)(seq + i));
+    const __m128i q    = _mm_loadu_si128((const __m128i*)(qual + i));
+    const __m128i l    = _mm_or_si128(s, lower);
+    const __m128i dna  = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(l, a), _mm_cmpeq_epi8(l, c)),
+                                      _mm_or_si128(_mm_cmpeq_epi8(l, g), _mm_cmpeq_epi8(l, t)));
+    // 16 bit shifts: the bits from the next byte are masked out
+    const __m128i code = _mm_and_si128(_mm_xor_si128(_mm_srli_epi16(s, 1), _mm_srli_epi16(s, 2)), mask);
+    const __m128i good = _mm_or_si128(code, _mm_and_si128(_mm_cmpgt_epi8(q, thres), hi));
+    _mm_storeu_si128((__m128i*)(res + i), _mm_or_si128(_mm_and_si128(dna, good), _mm_andnot_si128(dna, nd)));
+  }
+  encode_scalar(seq + i, qual + i, len - i, qual_thresh, res + i);
+}
+#endif
+
+#ifdef QUORUM_HAVE_AVX2_TARGET
+__attribute__((target("avx2")))
+inline void encode_avx2(const char* seq, const char* qual, size_t len, char qual_thresh, uint8_t* res) {
+  const __m256i lower = _mm256_set1_epi8(0x20);
+  const __m256i a = _mm256_set1_epi8('a'), c = _mm256_set1_epi8('c'), g = _mm256_set1_epi8('g'), t = _mm256_set1_epi8('t');
+  const __m256i mask  = _mm256_set1_epi8(code_mask);
+  const __m256i hi    = _mm256_set1_epi8(high);
+  const __m256i nd    = _mm256_set1_epi8((char)not_dna);
+  const __m256i thres = _mm256_set1_epi8(qual_thresh - 1);
+  size_t i = 0;
+  for( ; i + 32 <= len; i += 32) {
+    const __m256i s    = _mm256_loadu_si256((const __m256i*)(seq + i));
+    const __m256i q    = _mm256_loadu_si256((const __m256i*)(qual + i));
+    const __m256i l    = _mm256_or_si256(s, lower);
+    const __m256i dna  = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(l, a), _mm256_cmpeq_epi8(l, c)),
+                                         _mm256_or_si256(_mm256_cmpeq_epi8(l, g), _mm256_cmpeq_epi8(l, t)));
+    const __m256i code = _mm256_and_si256(_mm256_xor_si256(_mm256_srli_epi16(s, 1), _mm256_srli_epi16(s, 2)), mask);
+    const __m256i good = _mm256_or_si256(code, _mm256_and_si256(_mm256_cmpgt_epi8(q, thres), hi));
+    _mm256_storeu_si256((__m256i*)(res + i), _mm256_or_si256(_mm256_and_si256(dna, good), _mm256_andnot_si256(dna, nd)));
+  }
+  encode_scalar(seq + i, qual + i, len - i, qual_thresh, res + i);
+}
+
+inline bool have_avx2() {
+  static const bool res = __builtin_cpu_supports("avx2");
+  return res;
+}
+#endif
+
+// Encode seq[0..len) with qualities qual[0..len) into res[0..len),
+// with the widest instruction set available at run time.
+inline void encode(const char* seq, const char* qual, size_t len, char qual_thresh, uint8_t* res) {
+#ifdef QUORUM_HAVE_AVX2_TARGET
+  if(have_avx2()) {
+    encode_avx2(seq, qual, len, qual_thresh, res);
+    return;
+  }
+#endif
+#ifdef __SSE2__
+  encode_sse2(seq, qual, len, qual_thresh, res);
+#else
+  encode_scalar(seq, qual, len, qual_thresh, res);
+#endif
+}
+} // namespace read_encoding
+
+#endif /* __QUORUM_READ_ENCODER_HPP__ */
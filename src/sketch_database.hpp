@@ -0,0 +1,181 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_SKETCH_DATABASE_HPP__
+#define __QUORUM_SKETCH_DATABASE_HPP__
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <src/database_backend.hpp>
+#include <src/hyperloglog.hpp>
+#include <src/hot_table.hpp>
+
+// Blocked count-min sketch of the high and low quality counts of the
+// k-mers, with 8 bit counters. A block is a 64 byte cache line: 32
+// counters for the high quality sightings, then 32 for the low
+// quality ones. A k-mer has depth counters of each quality in one
+// block, so an update or a query costs one cache miss. The low
+// quality count of a k-mer only matters if it has no high quality
+// sighting: it is then its all quality count, as in the database.
+//
+// The updates are conservative (only the smallest counters are
+// incremented) and thread safe. A count saturates at max_count: the
+// sightings after that must be counted elsewhere.
+class count_min_sketch {
+public:
+  static const unsigned int block_bytes = 64;
+  static const unsigned int depth       = 4;
+  static const unsigned int max_count   = 255;
+
+private:
+  std::vector<uint64_t> words_;
+  uint8_t* const        blocks_;
+  const uint64_t        nb_blocks_;
+
+  // Counter i of a k-mer of hash h2, in the half of its block for the
+  // quality.
+  static unsigned int cell(uint64_t h2, unsigned int i, unsigned int quality) {
+    return (quality ? 0 : block_bytes / 2) + ((h2 >> (5 * i)) & 0x1f);
+  }
+
+public:
+  // Sketch with at least nb_counters counters of each quality
+  explicit count_min_sketch(uint64_t nb_counters) :
+    words_(block_bytes / sizeof(uint64_t) * std::max((uint64_t)1, (nb_counters + block_bytes / 2 - 1) / (block_bytes / 2)), 0),
+    blocks_((uint8_t*)words_.data()),
+    nb_blocks_(words_.size() * sizeof(uint64_t) / block_bytes)
+  { }
+
+  uint64_t nb_blocks() const { return nb_blocks_; }
+  size_t memory_usage() const { return nb_blocks_ * block_bytes; }
+  const uint8_t* blocks() const { return blocks_; }
+
+  static uint64_t hash(const jellyfish::mer_dna& m) { return mer_hash(m); }
+
+  // Count of the k-mer of hash h in the blocks
+  static unsigned int estimate(const uint8_t* blocks, uint64_t nb_blocks, uint64_t h, unsigned int quality) {
+    const uint8_t* const block = blocks + block_bytes * (h % nb_blocks);
+    const uint64_t       h2    = mix_bits(h);
+    unsigned int         res   = max_count;
+    for(unsigned int i = 0; i < depth; ++i)
+      res = std::min(res, (unsigned int)block[cell(h2, i, quality)]);
+    return res;
+  }
+  unsigned int estimate(uint64_t h, unsigned int quality) const {
+    return estimate(blocks_, nb_blocks_, h, quality);
+  }
+
+  // Add a sighting of the k-mer of hash h. Return false if its count
+  // is saturated.
+  bool add_hash(uint64_t h, unsigned int quality) {
+    uint8_t* const block = blocks_ + block_bytes * (h % nb_blocks_);
+    const uint64_t h2    = mix_bits(h);
+    unsigned int   min   = max_count;
+    for(unsigned int i = 0; i < depth; ++i)
+      min = std::min(min, (unsigned int)block[cell(h2, i, quality)]);
+    if(min == max_count)
+      return false;
+    for(unsigned int i = 0; i < depth; ++i) {
+      uint8_t* const c   = &block[cell(h2, i, quality)];
+      uint8_t        cur = *c;
+      while(cur <= min) {
+        const uint8_t prev = __sync_val_compare_and_swap(c, cur, (uint8_t)(min + 1));
+        if(prev == cur)
+          break;
+        cur = prev;
+      }
+    }
+    return true;
+  }
+  bool add(const jellyfish::mer_dna& m, unsigned int quality) { return add_hash(hash(m), quality); }
+
+  static void prefetch(const uint8_t* blocks, uint64_t nb_blocks, uint64_t h) {
+    __builtin_prefetch(blocks + block_bytes * (h % nb_blocks));
+  }
+};
+
+// Layout "sketch": approximate counts. The k-mers are not stored, the
+// counts are estimated by a count-min sketch, so they may be too high
+// (never too low) and absent k-mers may have a count. The k-mers whose
+// count saturates the sketch are in a small exact table of heavy
+// hitters (a hot_table), checked first.
+//
+// Data: the number of blocks of the sketch and the length in bytes of
+// the heavy hitter table as 64 bit words, the table, padding to a
+// multiple of 64 bytes in the file, then the blocks.
+class sketch_database : public database_backend {
+  const uint64_t             max_val_;
+  uint64_t                   nb_blocks_;
+  std::unique_ptr<hot_table> heavy_;
+  const uint8_t*             blocks_;
+
+  value_type get_hash(const mer_dna& m, uint64_t h) const {
+    const uint64_t v = heavy_->find_hash(m, h);
+    if(v)
+      return decode(v);
+    const uint64_t high = count_min_sketch::estimate(blocks_, nb_blocks_, h, 1);
+    if(high)
+      return value_type(std::min(high, max_val_), 1);
+    return value_type(std::min((uint64_t)count_min_sketch::estimate(blocks_, nb_blocks_, h, 0), max_val_), 0);
+  }
+
+public:
+  sketch_database(const database_header& header, char* base) :
+    database_backend(header),
+    max_val_((uint64_t)-1 >> (sizeof(uint64_t) * 8 - header.bits()))
+  {
+    const char* const data = base + header.offset();
+    uint64_t          heavy_bytes;
+    memcpy(&nb_blocks_, data, sizeof(nb_blocks_));
+    memcpy(&heavy_bytes, data + sizeof(uint64_t), sizeof(heavy_bytes));
+    std::istringstream is(std::string(data + 2 * sizeof(uint64_t), heavy_bytes));
+    heavy_.reset(new hot_table(is, header.key_words()));
+    const size_t start = header.offset() + 2 * sizeof(uint64_t) + heavy_bytes;
+    blocks_            = (const uint8_t*)(base + (start + 63) / 64 * 64);
+  }
+
+  virtual value_type get(const mer_dna& m) const { return get_hash(m, count_min_sketch::hash(m)); }
+
+  virtual cursor* new_cursor(bool with_keys) const {
+    throw std::runtime_error("The sketch database layout does not store the k-mers nor enumerate the counts");
+  }
+
+  // The hash positions are those of the heavy hitter table: ignore
+  // them and prefetch the sketch blocks instead.
+  virtual void probe_batch(const mer_dna* mers, const size_t* oids, value_type* vals, size_t n) const {
+    uint64_t hashes[max_batch * 4];
+    for(size_t start = 0; start < n; start += max_batch * 4) {
+      const size_t len = std::min(n - start, max_batch * 4);
+      for(size_t i = 0; i < len; ++i) {
+        hashes[i] = count_min_sketch::hash(mers[start + i]);
+        heavy_->prefetch_hash(hashes[i]);
+        count_min_sketch::prefetch(blocks_, nb_blocks_, hashes[i]);
+      }
+      for(size_t i = 0; i < len; ++i)
+        vals[start + i] = get_hash(mers[start + i], hashes[i]);
+    }
+  }
+};
+
+#endif /* __QUORUM_SKETCH_DATABASE_HPP__ */
@@ -0,0 +1,158 @@
+/* Quorum
+ * Copyright (C) 2012  Genome group at University of Maryland.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUORUM_SUPERMER_SPILLER_HPP__
+#define __QUORUM_SUPERMER_SPILLER_HPP__
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+
+#include <jellyfish/err.hpp>
+#include <jellyfish/mer_dna.hpp>
+#include <jellyfish/thread_exec.hpp>
+#include <jellyfish/stream_manager.hpp>
+#include <jellyfish/whole_sequence_parser.hpp>
+#include <jellyfish/locks_pthread.hpp>
+#include <src/hyperloglog.hpp>
+#include <src/minimizer.hpp>
+
+// Split the reads into super-mers: maximal runs of consecutive k-mers
+// with the same partition, given by their minimizer. Each super-mer
+// is appended, with its qualities, to the fastq file of its
+// partition. Consecutive super-mers of a read overlap by k-1 bases, so
+// every k-mer is in exactly one partition file. Each thread keeps a
+// buffer and a HyperLogLog sketch per partition, to size the hash of
+// each partition when counting it.
+class supermer_spiller : public jellyfish::thread_exec {
+public:
+  typedef std::vector<const char*>                                file_vector;
+  typedef jellyfish::stream_manager<file_vector::const_iterator> stream_manager;
+  typedef jellyfish::whole_sequence_parser<stream_manager>       read_parser;
+
+private:
+  read_parser                                        parser_;
+  const minimizer&                                   minimizer_;
+  std::vector<std::unique_ptr<std::ofstream> >       outputs_;
+  std::unique_ptr<jellyfish::locks::pthread::mutex[]> locks_;
+  std::vector<std::vector<hyperloglog> >             sketches_;
+
+  static const size_t       buffer_size = 1024 * 1024;
+  static const unsigned int sketch_bits = 10;
+
+public:
+  supermer_spiller(int nb_threads, stream_manager& streams, const minimizer& min,
+                   const std::vector<std::string>& paths) :
+    parser_(4 * nb_threads, 100, 1, streams),
+    minimizer_(min),
+    locks_(new jellyfish::locks::pthread::mutex[paths.size()]),
+    sketches_(nb_threads, std::vector<hyperloglog>(paths.size(), hyperloglog(sketch_bits)))
+  {
+    for(auto it = paths.cbegin(); it != paths.cend(); ++it) {
+      outputs_.push_back(std::unique_ptr<std::ofstream>(new std::ofstream(it->c_str())));
+      if(!outputs_.back()->good())
+        throw std::runtime_error(jellyfish::err::msg() << "Failed to open temporary file '" << *it << "'");
+    }
+  }
+
+  virtual void start(int thid) {
+    const size_t             nb_parts = outputs_.size();
+    std::vector<hyperloglog>& sketches = sketches_[thid];
+    std::vector<std::string>  buffers(nb_parts);
+    minimizer_window          window(minimizer_, jellyfish::mer_dna::k());
+    jellyfish::mer_dna        m, rm;
+
+    while(true) {
+      read_parser::job job(parser_);
+      if(job.is_empty()) break;
+
+      for(size_t i = 0; i < job->nb_filled; ++i) { // Process each read
+        const std::string& seq   = job->data[i].seq;
+        std::string&       quals = job->data[i].qual;
+        if(quals.size() < seq.size()) // No qualities in fasta
+          quals.resize(seq.size(), '\0');
+        size_t             start = 0;  // Start of the current super-mer
+        size_t             part  = nb_parts; // Its partition, nb_parts if none
+        window.reset();
+        for(size_t j = 0; j < seq.size(); ++j) {
+          int code = jellyfish::mer_dna::code(seq[j]);
+          if(jellyfish::mer_dna::not_dna(code)) {
+            spill(buffers, part, seq, quals, start, j);
+            part = nb_parts;
+            window.reset();
+            continue;
+          }
+          m.shift_left(code);
+          rm.shift_right(jellyfish::mer_dna::complement(code));
+          if(!window.push(code))
+            continue;
+          const size_t p = window.value() % nb_parts;
+          sketches[p].add(m < rm ? m : rm);
+          if(p != part) {
+            spill(buffers, part, seq, quals, start, j);
+            start = j + 1 - jellyfish::mer_dna::k();
+            part  = p;
+          }
+        }
+        spill(buffers, part, seq, quals, start, seq.size());
+      }
+    }
+    for(size_t p = 0; p < nb_parts; ++p)
+      flush(buffers[p], p);
+  }
+
+  // Estimated number of distinct k-mers in partition p
+  double estimate(size_t p) const {
+    hyperloglog res(sketch_bits);
+    for(auto it = sketches_.cbegin(); it != sketches_.cend(); ++it)
+      res.merge((*it)[p]);
+    return res.estimate();
+  }
+  double error() const { return hyperloglog(sketch_bits).error(); }
+
+  void close() {
+    for(auto it = outputs_.begin(); it != outputs_.end(); ++it) {
+      (*it)->close();
+      if((*it)->fail())
+        throw std::runtime_error(jellyfish::err::msg() << "Failed to write temporary file");
+    }
+  }
+
+private:
+  // Append seq[start, end) to the buffer of partition part
+  void spill(std::vector<std::string>& buffers, size_t part, const std::string& seq,
+             const std::string& quals, size_t start, size_t end) {
+    if(part >= buffers.size())
+      return;
+    std::string& buffer = buffers[part];
+    buffer.append("@\n").append(seq, start, end - start)
+      .append("\n+\n").append(quals, start, end - start).append("\n");
+    if(buffer.size() >= buffer_size)
+      flush(buffer, part);
+  }
+
+  void flush(std::string& buffer, size_t part) {
+    locks_[part].lock();
+    outputs_[part]->write(buffer.data(), buffer.size());
+    locks_[part].unlock();
+    buffer.clear();
+  }
+};
+
+#endif /* __QUORUM_SUPERMER_SPILLER_HPP__ */
@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <vector>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/bloom_filter.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+
+TEST(BloomFilter, InsertContains) {
+  static const size_t nb_mers = 10000;
+  static const double fpr     = 0.01;
+  mer_dna::k(31);
+  bloom_filter         filter(nb_mers, fpr);
+  std::vector<mer_dna> mers(nb_mers);
+
+  size_t nb_present = 0;
+  for(auto it = mers.begin(); it != mers.end(); ++it) {
+    it->randomize();
+    nb_present += filter.insert(*it);
+  }
+  EXPECT_GT(3 * fpr * nb_mers, nb_present);
+
+  // No false negative, and a second insertion finds the mer
+  for(auto it = mers.cbegin(); it != mers.cend(); ++it) {
+    EXPECT_TRUE(filter.contains(*it));
+    EXPECT_TRUE(filter.insert(*it));
+  }
+
+  size_t  false_positives = 0;
+  mer_dna m;
+  for(size_t i = 0; i < nb_mers; ++i) {
+    m.randomize();
+    false_positives += filter.contains(m);
+  }
+  EXPECT_GT(3 * fpr * nb_mers, false_positives);
+}
+
+TEST(BloomFilter, WriteRead) {
+  mer_dna::k(31);
+  bloom_filter         filter(1000, 0.01);
+  std::vector<mer_dna> mers(1000);
+  for(auto it = mers.begin(); it != mers.end(); ++it) {
+    it->randomize();
+    filter.insert(*it);
+  }
+
+  std::stringstream buffer;
+  filter.write(buffer);
+  const bloom_filter copy(buffer);
+  EXPECT_EQ(filter.memory_usage(), copy.memory_usage());
+  for(auto it = mers.cbegin(); it != mers.cend(); ++it)
+    EXPECT_TRUE(copy.contains(*it));
+  mer_dna m;
+  for(int i = 0; i < 1000; ++i) {
+    m.randomize();
+    EXPECT_EQ(filter.contains(m), copy.contains(m));
+  }
+}
+}
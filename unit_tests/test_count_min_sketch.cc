@@ -0,0 +1,52 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/sketch_database.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+
+TEST(CountMinSketch, NeverTooLow) {
+  static const size_t nb_mers = 10000;
+  mer_dna::k(31);
+  count_min_sketch     sketch(16 * nb_mers);
+  std::vector<mer_dna> mers(nb_mers);
+
+  for(size_t i = 0; i < nb_mers; ++i) {
+    mers[i].randomize();
+    const unsigned int count = 1 + i % 5;
+    for(unsigned int j = 0; j < count; ++j)
+      EXPECT_TRUE(sketch.add(mers[i], i % 2));
+  }
+
+  size_t too_high = 0;
+  for(size_t i = 0; i < nb_mers; ++i) {
+    const uint64_t     h     = count_min_sketch::hash(mers[i]);
+    const unsigned int count = 1 + i % 5;
+    EXPECT_LE(count, sketch.estimate(h, i % 2));
+    too_high += sketch.estimate(h, i % 2) != count;
+  }
+  EXPECT_GT(nb_mers / 10, too_high);
+
+  // Mostly absent from the other quality
+  size_t other = 0;
+  for(size_t i = 0; i < nb_mers; ++i)
+    other += sketch.estimate(count_min_sketch::hash(mers[i]), 1 - i % 2) > 0;
+  EXPECT_GT(nb_mers / 10, other);
+}
+
+TEST(CountMinSketch, Saturate) {
+  mer_dna::k(31);
+  count_min_sketch sketch(1000);
+  mer_dna          m;
+  m.randomize();
+  for(unsigned int i = 0; i < count_min_sketch::max_count; ++i)
+    EXPECT_TRUE(sketch.add(m, 1));
+  EXPECT_FALSE(sketch.add(m, 1));
+  EXPECT_EQ((unsigned int)count_min_sketch::max_count, sketch.estimate(count_min_sketch::hash(m), 1));
+  EXPECT_EQ((unsigned int)0, sketch.estimate(count_min_sketch::hash(m), 0));
+  EXPECT_TRUE(sketch.add(m, 0));
+}
+}
@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+
+#include <jellyfish/misc.hpp>
+#include <jellyfish/mer_dna.hpp>
+#include <src/fixed_mer.hpp>
+#include <src/kmer.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+
+// A fixed_mer shifted like a mer_dna has the same value and order
+template<unsigned int W>
+void compare_with_mer_dna(unsigned int k) {
+  SCOPED_TRACE(::testing::Message() << "k:" << k << " W:" << W);
+  mer_dna::k(k);
+  fixed_mer<W> fm, fm2;
+  mer_dna      m, m2, tmp;
+
+  for(int i = 0; i < 1000; ++i) {
+    const int c = jellyfish::random_bits(2);
+    if(jellyfish::random_bits(1)) {
+      fm.shift_left(c);
+      m.shift_left(c);
+    } else {
+      fm.shift_right(c);
+      m.shift_right(c);
+    }
+    if(i % 7 == 0) {
+      const unsigned int b = jellyfish::random_bits(16) % k;
+      fm.base(b)           = c;
+      m.base(b)            = c;
+    }
+    for(unsigned int w = 0; w < W; ++w)
+      ASSERT_EQ(m.word(w), fm.word(w));
+    ASSERT_EQ(m, to_mer_dna(fm, tmp));
+    ASSERT_EQ(m.to_str(), fm.to_str());
+    ASSERT_EQ(m < m2, fm < fm2);
+    ASSERT_EQ(m2 < m, fm2 < fm);
+    ASSERT_EQ(m == m2, fm == fm2);
+    if(i % 3 == 0) {
+      fm2 = fm;
+      m2  = m;
+    }
+  }
+}
+
+TEST(FixedMer, MerDna) {
+  for(unsigned int k = 1; k <= 32; ++k)
+    compare_with_mer_dna<1>(k);
+  for(unsigned int k = 33; k <= 64; ++k)
+    compare_with_mer_dna<2>(k);
+}
+
+TEST(FixedMer, Kmer) {
+  mer_dna::k(41);
+  EXPECT_EQ(2u, fixed_mer_words(mer_dna::k()));
+  basic_kmer<fixed_mer<2> > fk;
+  kmer_t                    k;
+  mer_dna                   tmp;
+  for(int i = 0; i < 1000; ++i) {
+    const int c = jellyfish::random_bits(2);
+    fk.shift_left(c);
+    k.shift_left(c);
+    EXPECT_EQ(k.canonical(), to_mer_dna(fk.canonical(), tmp));
+    EXPECT_EQ(k.rmer(), to_mer_dna(fk.rmer(), tmp));
+  }
+}
+}
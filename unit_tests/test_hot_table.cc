@@ -0,0 +1,50 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <vector>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/hot_table.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+
+TEST(HotTable, InsertFind) {
+  static const size_t nb_mers = 1000;
+  mer_dna::k(31);
+  hot_table            table(nb_mers);
+  std::vector<mer_dna> mers(nb_mers);
+  for(size_t i = 0; i < nb_mers; ++i) {
+    mers[i].randomize();
+    EXPECT_TRUE(table.insert(mers[i], 2 * i + 2));
+  }
+  EXPECT_TRUE(table.insert(mers[0], 5)); // Update
+
+  std::stringstream buffer;
+  table.write(buffer);
+  const hot_table copy(buffer, mer_dna::nb_words());
+  EXPECT_EQ(table.memory_usage(), copy.memory_usage());
+
+  for(size_t i = 0; i < nb_mers; ++i) {
+    EXPECT_EQ(i ? 2 * i + 2 : 5, table.find(mers[i]));
+    EXPECT_EQ(i ? 2 * i + 2 : 5, copy.find(mers[i]));
+  }
+  mer_dna m;
+  for(size_t i = 0; i < nb_mers; ++i) {
+    m.randomize();
+    EXPECT_EQ((uint64_t)0, copy.find(m));
+  }
+}
+
+TEST(HotTable, Full) {
+  mer_dna::k(17);
+  hot_table table(1);
+  mer_dna   m;
+  size_t    inserted = 0;
+  for(int i = 0; i < 10; ++i) {
+    m.randomize();
+    inserted += table.insert(m, 2);
+  }
+  EXPECT_EQ((size_t)2, inserted);
+}
+}
@@ -0,0 +1,24 @@
+#include <gtest/gtest.h>
+
+#include <jellyfish/misc.hpp>
+#include <src/hyperloglog.hpp>
+
+namespace {
+TEST(HyperLogLog, Estimate) {
+  static const size_t sizes[] = { 100, 10000, 1000000 };
+  for(size_t s : sizes) {
+    SCOPED_TRACE(::testing::Message() << "size:" << s);
+    hyperloglog hll1, hll2;
+    for(size_t i = 0; i < s; ++i) {
+      const uint64_t h = mix_bits(i);
+      hll1.add_hash(h);
+      hll1.add_hash(h); // Duplicates do not count
+      if(i % 2 == 0)
+        hll2.add_hash(h);
+    }
+    EXPECT_NEAR((double)s, hll1.estimate(), 4 * hll1.error() * s);
+    hll2.merge(hll1);
+    EXPECT_NEAR((double)s, hll2.estimate(), 4 * hll2.error() * s);
+  }
+}
+}
@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+
+#include <jellyfish/mer_dna.hpp>
+#include <src/lookup_cache.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+typedef lookup_cache::value_type value_type;
+
+TEST(LookupCache, GetPut) {
+  mer_dna::k(31);
+  lookup_cache cache(4);
+  mer_dna      m;
+  m.randomize();
+
+  value_type v(0, 0);
+  EXPECT_FALSE(cache.get(m, lookup_cache::single, &v));
+  const value_type one(10, 1);
+  cache.put(m, lookup_cache::single, &one);
+  EXPECT_TRUE(cache.get(m, lookup_cache::single, &v));
+  EXPECT_EQ(one, v);
+  EXPECT_FALSE(cache.get(m, lookup_cache::siblings, &v));
+
+  // The siblings are found from any of the 4 mers
+  const value_type four[4] = { value_type(1, 0), value_type(0, 0), value_type(5, 1), value_type(2, 1) };
+  cache.put(m, lookup_cache::siblings, four);
+  for(int b = 0; b < 4; ++b) {
+    value_type res[4];
+    m.base(0) = b;
+    EXPECT_TRUE(cache.get(m, lookup_cache::siblings, res));
+    for(int i = 0; i < 4; ++i)
+      EXPECT_EQ(four[i], res[i]);
+  }
+  EXPECT_EQ((uint64_t)7, cache.lookups());
+  EXPECT_EQ((uint64_t)5, cache.hits());
+}
+
+// Random mers are either missing or found with their own value
+TEST(LookupCache, Collisions) {
+  mer_dna::k(45);
+  lookup_cache cache(6);
+  mer_dna      mers[1000];
+  for(int i = 0; i < 1000; ++i) {
+    mers[i].randomize();
+    const value_type v(i, i % 2);
+    cache.put(mers[i], lookup_cache::single, &v);
+  }
+  int found = 0;
+  for(int i = 0; i < 1000; ++i) {
+    value_type v;
+    if(cache.get(mers[i], lookup_cache::single, &v)) {
+      ++found;
+      EXPECT_EQ(value_type(i, i % 2), v);
+    }
+  }
+  EXPECT_GE(64, found);
+  EXPECT_LT(0, found);
+}
+
+TEST(LookupCache, Disabled) {
+  mer_dna::k(31);
+  lookup_cache     cache(0);
+  mer_dna          m;
+  const value_type one(1, 1);
+  value_type       v;
+  cache.put(m, lookup_cache::single, &one);
+  EXPECT_FALSE(cache.get(m, lookup_cache::single, &v));
+  EXPECT_EQ((uint64_t)0, cache.lookups());
+}
+}
@@ -1,11 +1,21 @@
 #include <fstream>
+#include <cstring>
+#include <ostream>
+#include <algorithm>
+#include <memory>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
 #include <unit_tests/test_misc.hpp>
 #include <src/mer_database.hpp>
+#include <src/kmer.hpp>
+#include <src/minimizer.hpp>
+#include <src/bloom_filter.hpp>
+#include <src/mphf_database.hpp>
+#include <src/lookup_cache.hpp>
 #include <jellyfish/mer_dna.hpp>
 #include <jellyfish/misc.hpp>
 
@@ -42,6 +52,83 @@ void test_sequence(const database_query& hash, const std::string& seq, const uin
   }
 }
 
+// Insert in the hash, with 3 threads, the k-mers of hq twice in high
+// quality and the k-mers of lq once in low quality
+void insert_hq_lq(hash_with_quality* hash, const std::string& hq, const std::string& lq) {
+  std::thread th_hq_1(insert_sequence, hash, hq, 1);
+  std::thread th_hq_2(insert_sequence, hash, hq, 1);
+  std::thread th_lq_1(insert_sequence, hash, lq, 0);
+  th_hq_1.join();
+  th_hq_2.join();
+  th_lq_1.join();
+}
+
+// Write the hash in the split layout to path, and return the header
+database_header write_split(const hash_with_quality& hash, const std::string& path,
+                            database_header header = database_header()) {
+  std::ofstream os(path.c_str());
+  hash.write(os, &header);
+  EXPECT_TRUE(os.good());
+  EXPECT_EQ("split", header.layout());
+  return header;
+}
+
+// The databases have the same k-mers with the same values
+void expect_same_content(const database_query& a, const database_query& b) {
+  size_t nb_a = 0, nb_b = 0;
+  for(auto it = a.begin(); it != a.end(); ++it, ++nb_a)
+    EXPECT_EQ(it->second, b[*it->first]);
+  for(auto it = b.begin(); it != b.end(); ++it, ++nb_b)
+    EXPECT_EQ(it->second, a[*it->first]);
+  EXPECT_EQ(nb_a, nb_b);
+}
+
+// Result of get_best_alternatives()
+struct alternatives {
+  int      res;
+  uint64_t counts[4];
+  int      ucode;
+  int      level;
+  alternatives() : ucode(0) { }
+  bool operator==(const alternatives& rhs) const {
+    return res == rhs.res && level == rhs.level && std::equal(counts, counts + 4, rhs.counts);
+  }
+};
+std::ostream& operator<<(std::ostream& os, const alternatives& a) {
+  return os << "res:" << a.res << " level:" << a.level << " counts:" << a.counts[0] << ',' << a.counts[1]
+            << ',' << a.counts[2] << ',' << a.counts[3];
+}
+template<typename Mer>
+alternatives best_alternatives(const database_query& db, const Mer& mer) {
+  alternatives res;
+  res.res = db.get_best_alternatives(mer, res.counts, res.ucode, res.level);
+  return res;
+}
+template<typename Mer>
+alternatives best_alternatives(const database_query& db, const Mer& mer, database_query::sibling_batch& batch,
+                               lookup_cache& cache) {
+  alternatives res;
+  res.res = db.get_best_alternatives(mer, batch, cache, res.counts, res.ucode, res.level);
+  return res;
+}
+
+// The values and the substitutions of a base, in both directions, of
+// the k-mers of seq agree in the databases
+void expect_same_alternatives(const database_query& a, const database_query& b, const std::string& seq) {
+  kmer_t mer;
+  for(size_t i = 0; i < seq.size(); ++i) {
+    mer.shift_left(seq[i]);
+    if(i + 1 < mer_dna::k())
+      continue;
+    SCOPED_TRACE(::testing::Message() << "i:" << i);
+    EXPECT_EQ(a[mer.canonical()], b[mer.canonical()]);
+    const forward_mer  fmer(mer);
+    EXPECT_EQ(best_alternatives(a, fmer), best_alternatives(b, fmer));
+    const backward_mer bmer(mer);
+    EXPECT_EQ(best_alternatives(a, bmer), best_alternatives(b, bmer));
+  }
+}
+
 class MerDatabase : public ::testing::TestWithParam<int> { };
 
 TEST_P(MerDatabase, WriteRead) {
@@ -134,6 +221,944 @@ TEST_P(MerDatabase, WriteRead) {
   }
 }
 
+TEST_P(MerDatabase, WritePacked) {
+  file_unlink split_file("mer_database_split");
+  file_unlink packed_file("mer_database_packed");
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(33);
+
+  {
+    hash_with_quality database(GetParam() * sequence_len, mer_dna::k() * 2, bits, 4);
+    insert_hq_lq(&database, hq, lq);
+    write_split(database, split_file.path);
+
+    std::ofstream packed_os(packed_file.path.c_str());
+    database_header packed_header;
+    database.write_packed(packed_os, &packed_header, 2);
+    EXPECT_TRUE(packed_os.good());
+    EXPECT_EQ("packed", packed_header.layout());
+    EXPECT_EQ((uint64_t)0, packed_header.value_bytes());
+    EXPECT_EQ((std::ofstream::pos_type)(packed_header.offset() + packed_header.key_bytes()), packed_os.tellp());
+  }
+
+  database_query split(split_file.path.c_str());
+  database_query packed(packed_file.path.c_str());
+  EXPECT_EQ(bits, packed.header().bits());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(packed, hq, 2, 1, "hq", mer_map);
+  test_sequence(packed, lq, 1, 0, "lq", mer_map);
+  expect_same_content(split, packed);
+
+  // Batch lookups, larger than a prefetch batch, agree with single lookups
+  std::vector<mer_dna>                  mers;
+  std::vector<std::pair<uint64_t, int> > vals;
+  for(const std::string& seq : { hq, lq, generate_sequence(1000) })
+    for(size_t i = 0; i <= seq.size() - mer_dna::k(); i += 7)
+      mers.push_back(mer_dna(seq.substr(i, mer_dna::k())));
+  vals.resize(mers.size());
+  for(const database_query* db : { &split, &packed }) {
+    db->get_batch(mers.data(), vals.data(), mers.size());
+    for(size_t i = 0; i < mers.size(); ++i)
+      ASSERT_EQ((*db)[mers[i]], vals[i]);
+  }
+}
+
+TEST_P(MerDatabase, WriteNeighbor) {
+  file_unlink split_file("mer_database_split");
+  file_unlink neighbor_file("mer_database_neighbor");
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(33);
+
+  {
+    hash_with_quality database(GetParam() * sequence_len, mer_dna::k() * 2, bits, 4);
+    insert_hq_lq(&database, hq, lq);
+    write_split(database, split_file.path);
+
+    std::ofstream neighbor_os(neighbor_file.path.c_str());
+    database_header neighbor_header;
+    database.write_neighbor(neighbor_os, &neighbor_header, 2);
+    EXPECT_TRUE(neighbor_os.good());
+    EXPECT_EQ("neighbor", neighbor_header.layout());
+    EXPECT_EQ(4 * (bits + 1), neighbor_header.val_len());
+  }
+
+  database_query split(split_file.path.c_str());
+  database_query neighbor(neighbor_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(neighbor, hq, 2, 1, "hq", mer_map);
+  test_sequence(neighbor, lq, 1, 0, "lq", mer_map);
+  expect_same_content(split, neighbor);
+  // Some of the mers are in the database, some are not
+  expect_same_alternatives(split, neighbor, hq.substr(0, 1000) + generate_sequence(1000));
+}
+
+TEST_P(MerDatabase, WriteInPlace) {
+  file_unlink database_file("mer_database_in_place");
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(33);
+  {
+    // Small initial size to grow the table in new files
+    hash_with_quality database(GetParam() * sequence_len / 10, mer_dna::k() * 2, bits, 3, 126,
+                               database_file.path.c_str());
+    std::thread th_hq_1(insert_sequence, &database, hq, 1);
+    std::thread th_hq_2(insert_sequence, &database, hq, 1);
+    std::thread th_lq_1(insert_sequence, &database, lq, 0);
+    th_hq_1.join();
+    th_hq_2.join();
+    th_lq_1.join();
+
+    database_header header;
+    database.write_in_place(&header);
+    EXPECT_EQ("split", header.layout());
+  }
+  EXPECT_EQ(0, access(database_file.path.c_str(), R_OK));
+  EXPECT_NE(0, access((database_file.path + ".tmp0").c_str(), F_OK));
+
+  database_query database(database_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(database, hq, 2, 1, "hq", mer_map);
+  test_sequence(database, lq, 1, 0, "lq", mer_map);
+  size_t nb_mers = 0;
+  for(auto it = database.begin(); it != database.end(); ++it, ++nb_mers)
+    EXPECT_EQ(mer_map[*it->first], it->second);
+  EXPECT_EQ(mer_map.size(), nb_mers);
+}
+
+TEST_P(MerDatabase, WriteSharded) {
+  file_unlink index_file("mer_database_sharded");
+  file_unlink shard_files[2] = { file_unlink("mer_database_sharded.0"), file_unlink("mer_database_sharded.1") };
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(33);
+  const minimizer min(11);
+
+  database_header index;
+  for(int s = 0; s < 2; ++s) {
+    // Insert in shard s the k-mers whose minimizer is s modulo 2
+    hash_with_quality database(GetParam() * sequence_len / 2, mer_dna::k() * 2, bits, 1);
+    mer_dna           m;
+    for(int q = 0; q < 2; ++q) {
+      const std::string& seq = q ? hq : lq;
+      for(size_t i = 0; i <= seq.size() - mer_dna::k(); ++i) {
+        m = seq.substr(i, mer_dna::k());
+        if(min(m) % 2 != (uint64_t)s)
+          continue;
+        for(int j = 0; j <= q; ++j)
+          ASSERT_TRUE(database.add(m, q));
+      }
+    }
+    database.done();
+
+    std::ofstream   os(shard_files[s].path.c_str());
+    database_header header;
+    database.write(os, &header);
+    EXPECT_TRUE(os.good());
+    if(s == 0) {
+      index.matrix(header.matrix());
+      index.size(header.size());
+    }
+    index.add_shard(shard_files[s].path);
+  }
+  {
+    std::ofstream os(index_file.path.c_str());
+    index.set_format();
+    index.layout("sharded");
+    index.minimizer_len(min.m());
+    index.write(os);
+  }
+
+  database_query sharded(index_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(sharded, hq, 2, 1, "hq", mer_map);
+  test_sequence(sharded, lq, 1, 0, "lq", mer_map);
+
+  size_t nb_mers = 0;
+  for(auto it = sharded.begin(); it != sharded.end(); ++it, ++nb_mers)
+    EXPECT_EQ(mer_map[*it->first], it->second);
+  EXPECT_EQ(mer_map.size(), nb_mers);
+}
+
+TEST_P(MerDatabase, WriteMphf) {
+  file_unlink split_file("mer_database_split");
+  file_unlink mphf_file("mer_database_mphf");
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(31);
+
+  {
+    hash_with_quality database(GetParam() * sequence_len, mer_dna::k() * 2, bits, 3);
+    insert_hq_lq(&database, hq, lq);
+    write_split(database, split_file.path);
+  }
+
+  database_query split(split_file.path.c_str());
+  {
+    std::ofstream   os(mphf_file.path.c_str());
+    database_header header;
+    write_mphf_database(split.backend(), split.header().key_len(), split.header().bits(), os, header, 64);
+    EXPECT_TRUE(os.good());
+    EXPECT_EQ("mphf", header.layout());
+  }
+
+  // With k <= 32 and 64 bit fingerprints, the lookups are exact
+  database_query mphf(mphf_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(mphf, hq, 2, 1, "hq", mer_map);
+  test_sequence(mphf, lq, 1, 0, "lq", mer_map);
+  const std::string other = generate_sequence(10000);
+  mer_dna           m;
+  for(size_t i = 0; i <= other.size() - mer_dna::k(); ++i) {
+    m = other.substr(i, mer_dna::k());
+    EXPECT_EQ(split[m], mphf[m]);
+  }
+
+  // The values only cursor sees the same values
+  std::map<std::pair<uint64_t, int>, size_t> split_vals, mphf_vals;
+  for(auto it = mer_map.cbegin(); it != mer_map.cend(); ++it)
+    ++split_vals[it->second];
+  std::unique_ptr<database_backend::cursor> c(mphf.backend().new_cursor(false));
+  while(c->next())
+    ++mphf_vals[c->val()];
+  EXPECT_EQ(split_vals, mphf_vals);
+
+  expect_same_alternatives(split, mphf, hq.substr(0, 1000) + generate_sequence(1000));
+}
+
+// The lookup filter does not change the answers
+TEST_P(MerDatabase, LookupFilter) {
+  file_unlink plain_file("mer_database_plain");
+  file_unlink filtered_file("mer_database_filtered");
+  file_unlink filter_file("mer_database_filtered.filter");
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(33);
+
+  {
+    hash_with_quality database(GetParam() * sequence_len, mer_dna::k() * 2, bits, 3);
+    insert_hq_lq(&database, hq, lq);
+    write_split(database, plain_file.path);
+    database_header filtered_header;
+    filtered_header.filter("mer_database_filtered.filter");
+    write_split(database, filtered_file.path, filtered_header);
+  }
+  write_lookup_filter(filtered_file.path.c_str(), 0.01);
+
+  database_query plain(plain_file.path.c_str());
+  database_query filtered(filtered_file.path.c_str());
+  EXPECT_TRUE(dynamic_cast<const filtered_database*>(&filtered.backend()) != 0);
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(filtered, hq, 2, 1, "hq", mer_map);
+  test_sequence(filtered, lq, 1, 0, "lq", mer_map);
+  expect_same_alternatives(plain, filtered, hq.substr(0, 1000) + generate_sequence(1000));
+}
+
+// The hot table holds the most frequent k-mers and does not change
+// the answers
+TEST_P(MerDatabase, HotTable) {
+  file_unlink plain_file("mer_database_plain");
+  file_unlink hot_file("mer_database_hot");
+  file_unlink table_file("mer_database_hot.hot");
+  file_unlink filter_file("mer_database_hot.filter");
+
+  static const size_t       sequence_len = 10000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(33);
+
+  {
+    hash_with_quality database(GetParam() * sequence_len, mer_dna::k() * 2, bits, 1);
+    for(int i = 0; i < 3; ++i)
+      insert_sequence(&database, hq.substr(0, 1000), 1);
+    insert_sequence(&database, hq, 1);
+    insert_sequence(&database, lq, 0);
+    write_split(database, plain_file.path);
+    database_header hot_header;
+    hot_header.hot("mer_database_hot.hot");
+    hot_header.filter("mer_database_hot.filter");
+    write_split(database, hot_file.path, hot_header);
+  }
+  // The first 1000 - k + 1 k-mers have a count of 4, the others 1
+  write_lookup_filter(hot_file.path.c_str(), 0.01);
+  write_hot_table(hot_file.path.c_str(), 500);
+
+  database_query plain(plain_file.path.c_str());
+  // The hot table does not depend on mer_dna::k() when opened
+  mer_dna::k(31);
+  database_query hot(hot_file.path.c_str());
+  mer_dna::k(33);
+  EXPECT_TRUE(dynamic_cast<const hot_database*>(&hot.backend()) != 0);
+  {
+    std::ifstream          is(table_file.path.c_str());
+    jellyfish::file_header header(is);
+    const hot_table        table(is, mer_dna::nb_words());
+    mer_dna                m;
+    size_t                 nb_hot = 0;
+    for(size_t i = 0; i <= hq.size() - mer_dna::k(); ++i) {
+      m = hq.substr(i, mer_dna::k());
+      const uint64_t val = table.find(m);
+      if(val) {
+        ++nb_hot;
+        EXPECT_EQ((uint64_t)(4 << 1 | 1), val);
+      }
+    }
+    EXPECT_EQ((size_t)500, nb_hot);
+  }
+
+  expect_same_alternatives(plain, hot, hq.substr(0, 2000) + generate_sequence(1000));
+}
+
+// Lookups through a small cache give the same answers
+TEST_P(MerDatabase, LookupCache) {
+  file_unlink file("mer_database_cached_lookups");
+
+  static const size_t       sequence_len = 10000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  mer_dna::k(35);
+  {
+    hash_with_quality database(GetParam() * sequence_len, mer_dna::k() * 2, bits, 1);
+    insert_sequence(&database, hq, 1);
+    insert_sequence(&database, lq, 0);
+    write_split(database, file.path);
+  }
+
+  database_query                db(file.path.c_str());
+  lookup_cache                  cache(6);
+  database_query::sibling_batch batch;
+  // Twice the same sequence, so the second pass hits the cache
+  const std::string seq = generate_sequence(100) + hq.substr(0, 200) + lq.substr(0, 200);
+  for(int pass = 0; pass < 2; ++pass) {
+    kmer_t mer;
+    for(size_t i = 0; i < seq.size(); ++i) {
+      mer.shift_left(seq[i]);
+      if(i + 1 < mer_dna::k())
+        continue;
+      SCOPED_TRACE(::testing::Message() << "pass:" << pass << " i:" << i);
+      EXPECT_EQ(db.get_val(mer.canonical()), db.get_val(mer.canonical(), cache));
+      const forward_mer  fmer(mer);
+      EXPECT_EQ(best_alternatives(db, fmer), best_alternatives(db, fmer, batch, cache));
+      const backward_mer bmer(mer);
+      EXPECT_EQ(best_alternatives(db, bmer), best_alternatives(db, bmer, batch, cache));
+    }
+  }
+  EXPECT_LT((uint64_t)0, cache.hits());
+}
+
+TEST_P(MerDatabase, WriteCuckoo) {
+  file_unlink split_file("mer_database_split");
+  file_unlink cuckoo_file("mer_database_cuckoo");
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 4;
+  std::string hq  = generate_sequence(sequence_len);
+  std::string lq  = generate_sequence(sequence_len);
+
+  // Two words for k = 33: two slots per bucket, no SIMD
+  for(unsigned int k = 31; k <= 33; k += 2) {
+    SCOPED_TRACE(::testing::Message() << "k:" << k);
+    mer_dna::k(k);
+    {
+      hash_with_quality database(GetParam() * sequence_len, mer_dna::k() * 2, bits, 3);
+      insert_hq_lq(&database, hq, lq);
+      write_split(database, split_file.path);
+    }
+
+    database_query split(split_file.path.c_str());
+    {
+      std::ofstream   os(cuckoo_file.path.c_str());
+      database_header header;
+      write_cuckoo_database(split.backend(), split.header().key_len(), split.header().bits(), os, header);
+      EXPECT_TRUE(os.good());
+      EXPECT_EQ("cuckoo", header.layout());
+    }
+
+    // The layout does not depend on mer_dna::k() when opened
+    mer_dna::k(k == 31 ? 33 : 31);
+    database_query cuckoo(cuckoo_file.path.c_str());
+    mer_dna::k(k);
+    std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+    test_sequence(cuckoo, hq, 2, 1, "hq", mer_map);
+    test_sequence(cuckoo, lq, 1, 0, "lq", mer_map);
+    expect_same_content(split, cuckoo);
+
+    // The key of an empty slot is 0, i.e. poly-A
+    const mer_dna poly_a(std::string(mer_dna::k(), 'A'));
+    EXPECT_EQ(split[poly_a], cuckoo[poly_a]);
+
+    expect_same_alternatives(split, cuckoo, hq.substr(0, 1000) + generate_sequence(1000));
+  }
+}
+
+// Distinct hashes are mapped to distinct indices in [0, n)
+TEST(Mphf, Minimal) {
+  static const size_t   nb_hashes = 100000;
+  std::vector<uint64_t> hashes(nb_hashes);
+  for(size_t i = 0; i < nb_hashes; ++i)
+    hashes[i] = mix_bits(i);
+  std::vector<uint64_t> left = hashes;
+  left.push_back(hashes[0]); // Duplicate hashes can't be placed
+  const std::vector<uint64_t> function = mphf::build(left, 2.0);
+  const mphf                  f(function.data());
+  EXPECT_EQ((size_t)2, left.size());
+  EXPECT_GT(4.0 * nb_hashes, function.size() * 64.0);
+
+  std::vector<bool> used(nb_hashes - 1, false);
+  for(size_t i = 1; i < nb_hashes; ++i) {
+    const size_t index = f(hashes[i]);
+    ASSERT_GT(nb_hashes - 1, index);
+    EXPECT_FALSE(used[index]);
+    used[index] = true;
+  }
+  EXPECT_EQ((size_t)mphf::npos, f(hashes[0]));
+}
+
+// Adding through a cache gives the same database: the counts
+// saturate and the high quality wins.
+TEST(MerDatabaseCache, SameContent) {
+  file_unlink direct_file("mer_database_direct");
+  file_unlink cached_file("mer_database_cached");
+
+  static const unsigned int bits = 2;
+  const std::string hq   = generate_sequence(10000);
+  const std::string lq   = generate_sequence(10000);
+  const std::string lqhq = generate_sequence(10000);
+
+  mer_dna::k(25);
+  {
+    hash_with_quality       direct(100000, mer_dna::k() * 2, bits, 1);
+    hash_with_quality       cached(100000, mer_dna::k() * 2, bits, 1);
+    hash_with_quality_cache cache(cached, 4); // Small, to exercise the evictions
+    mer_dna                 m;
+    for(int r = 0; r < 5; ++r) {
+      const std::string* seqs[3]  = { &hq, &lq, &lqhq };
+      const unsigned int quals[3] = { 1, 0, r == 4 };
+      for(int j = 0; j < 3; ++j) {
+        for(size_t i = 0; i <= seqs[j]->size() - mer_dna::k(); ++i) {
+          m = seqs[j]->substr(i, mer_dna::k());
+          ASSERT_TRUE(direct.add(m, quals[j]));
+          ASSERT_TRUE(cache.add(m, quals[j]));
+        }
+      }
+    }
+    ASSERT_TRUE(cache.flush());
+    direct.done();
+    cached.done();
+
+    std::ofstream   direct_os(direct_file.path.c_str());
+    database_header direct_header;
+    direct.write(direct_os, &direct_header);
+    std::ofstream   cached_os(cached_file.path.c_str());
+    database_header cached_header;
+    cached.write(cached_os, &cached_header);
+  }
+
+  database_query direct(direct_file.path.c_str());
+  database_query cached(cached_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(cached, hq, 3, 1, "hq", mer_map);
+  test_sequence(cached, lq, 3, 0, "lq", mer_map);
+  test_sequence(cached, lqhq, 1, 1, "lqhq", mer_map);
+
+  size_t nb_direct = 0, nb_cached = 0;
+  for(auto it = direct.begin(); it != direct.end(); ++it, ++nb_direct)
+    EXPECT_EQ(it->second, cached[*it->first]);
+  for(auto it = cached.begin(); it != cached.end(); ++it, ++nb_cached)
+    EXPECT_EQ(it->second, direct[*it->first]);
+  EXPECT_EQ(nb_direct, nb_cached);
+}
+
+// With a reprobe limit of 1, the new table of a migration often has
+// no room for some entries of the old one. They are set aside, and
+// must be added back by done() when no later add() grows the table.
+TEST(MerDatabaseMigration, SetAsideEntries) {
+  file_unlink file("mer_database_set_aside");
+  mer_dna::k(31);
+
+  for(int round = 0; round < 20; ++round) {
+    SCOPED_TRACE(::testing::Message() << "round:" << round);
+    const std::string seq = generate_sequence(2000);
+    {
+      hash_with_quality database(16, mer_dna::k() * 2, 5, 1, 1);
+      insert_sequence(&database, seq, 1);
+      EXPECT_TRUE(database.done());
+      std::ofstream   os(file.path.c_str());
+      database_header header;
+      database.write(os, &header);
+      EXPECT_TRUE(os.good());
+    }
+
+    database_query database(file.path.c_str());
+    std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+    test_sequence(database, seq, 1, 1, "seq", mer_map);
+    size_t nb_mers = 0;
+    for(auto it = database.begin(); it != database.end(); ++it)
+      ++nb_mers;
+    EXPECT_EQ(mer_map.size(), nb_mers);
+  }
+}
+
+// With a Bloom filter in front, the low quality k-mers seen once are
+// not in the hash, the others have their exact counts (barring false
+// positives).
+TEST(MerDatabasePrefiltered, Counts) {
+  file_unlink database_file("mer_database_prefiltered");
+
+  static const unsigned int bits = 4;
+  const std::string lq1  = generate_sequence(10000);
+  const std::string lq3  = generate_sequence(10000);
+  const std::string hq1  = generate_sequence(10000);
+  const std::string lqhq = generate_sequence(10000);
+
+  mer_dna::k(25);
+  {
+    hash_with_quality database(10000, mer_dna::k() * 2, bits, 1);
+    bloom_filter      filter(40000, 0.0001);
+    database.prefiltered(true);
+    const std::string* seqs[7]  = { &lq1, &lq3, &lq3, &lq3, &lqhq, &hq1, &lqhq };
+    const unsigned int quals[7] = { 0, 0, 0, 0, 0, 1, 1 };
+    mer_dna            m;
+    for(int j = 0; j < 7; ++j) {
+      for(size_t i = 0; i <= seqs[j]->size() - mer_dna::k(); ++i) {
+        m = seqs[j]->substr(i, mer_dna::k());
+        if(!quals[j] && !filter.insert(m))
+          continue;
+        ASSERT_TRUE(database.add(m, quals[j]));
+      }
+    }
+    database.done();
+
+    std::ofstream   os(database_file.path.c_str());
+    database_header header;
+    database.write(os, &header);
+  }
+
+  database_query database(database_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(database, lq3, 3, 0, "lq3", mer_map);
+  test_sequence(database, hq1, 1, 1, "hq1", mer_map);
+  test_sequence(database, lqhq, 1, 1, "lqhq", mer_map);
+  size_t  nb_lq1 = 0;
+  mer_dna m;
+  for(size_t i = 0; i <= lq1.size() - mer_dna::k(); ++i) {
+    m = lq1.substr(i, mer_dna::k());
+    nb_lq1 += database[m].first > 0;
+  }
+  EXPECT_GT((size_t)10, nb_lq1);
+}
+
+// Merging databases gives the same counts as counting all the k-mers
+// together
+TEST_P(MerDatabase, Merge) {
+  file_unlink split_file("mer_database_merge_split");
+  file_unlink packed_file("mer_database_merge_packed");
+  file_unlink merged_file("mer_database_merged");
+
+  static const size_t       sequence_len = 10000;
+  static const unsigned int bits         = 4;
+  std::string hq   = generate_sequence(sequence_len);
+  std::string lq   = generate_sequence(sequence_len);
+  std::string lqhq = generate_sequence(sequence_len);
+  std::string hq1  = generate_sequence(sequence_len);
+  std::string many = generate_sequence(100);
+
+  mer_dna::k(33);
+
+  {
+    hash_with_quality database(GetParam() * 1000, mer_dna::k() * 2, bits, 1);
+    insert_sequence(&database, hq, 1);
+    insert_sequence(&database, hq, 1);
+    insert_sequence(&database, lq, 0);
+    insert_sequence(&database, lqhq, 0);
+    for(int i = 0; i < 10; ++i)
+      insert_sequence(&database, many, 1);
+    std::ofstream   os(split_file.path.c_str());
+    database_header header;
+    database.write(os, &header);
+  }
+  {
+    hash_with_quality database(GetParam() * 1000, mer_dna::k() * 2, bits, 1);
+    insert_sequence(&database, hq, 1);
+    insert_sequence(&database, lq, 0);
+    insert_sequence(&database, lqhq, 1);
+    insert_sequence(&database, hq1, 1);
+    for(int i = 0; i < 10; ++i)
+      insert_sequence(&database, many, 1);
+    std::ofstream   os(packed_file.path.c_str());
+    database_header header;
+    database.write_packed(os, &header);
+  }
+
+  {
+    static const int                     nb_threads = 4;
+    database_query                       split(split_file.path.c_str());
+    database_query                       packed(packed_file.path.c_str());
+    std::vector<const database_backend*> dbs;
+    dbs.push_back(&split.backend());
+    dbs.push_back(&packed.backend());
+    hash_with_quality database(1000, mer_dna::k() * 2, bits, nb_threads);
+    database_merger   merger(dbs, database, nb_threads);
+    merger.exec_join(nb_threads);
+    EXPECT_FALSE(merger.full());
+    std::ofstream   os(merged_file.path.c_str());
+    database_header header;
+    database.write(os, &header);
+  }
+
+  database_query merged(merged_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(merged, hq, 3, 1, "hq", mer_map);
+  test_sequence(merged, lq, 2, 0, "lq", mer_map);
+  test_sequence(merged, lqhq, 1, 1, "lqhq", mer_map);
+  test_sequence(merged, hq1, 1, 1, "hq1", mer_map);
+  test_sequence(merged, many, 15, 1, "many", mer_map);
+  size_t nb_mers = 0;
+  for(auto it = merged.begin(); it != merged.end(); ++it)
+    ++nb_mers;
+  EXPECT_EQ(mer_map.size(), nb_mers);
+}
+
+// Update a database with new k-mers, in a small hash that grows
+TEST_P(MerDatabase, Update) {
+  file_unlink database_file("mer_database_update");
+
+  static const size_t       sequence_len = 10000;
+  static const unsigned int bits         = 4;
+  std::string hq   = generate_sequence(sequence_len);
+  std::string lqhq = generate_sequence(sequence_len);
+  std::string lq   = generate_sequence(sequence_len);
+
+  mer_dna::k(31);
+
+  {
+    hash_with_quality database(GetParam() * 1000, mer_dna::k() * 2, bits, 1);
+    insert_sequence(&database, hq, 1);
+    insert_sequence(&database, lqhq, 0);
+    std::ofstream   os(database_file.path.c_str());
+    database_header header;
+    database.write(os, &header);
+  }
+
+  // The output overwrites the database
+  {
+    std::unique_ptr<database_query> existing(new database_query(database_file.path.c_str(), load_options(true, 2)));
+    const std::vector<const database_backend*> dbs(1, &existing->backend());
+    hash_with_quality database(100, mer_dna::k() * 2, bits, 2);
+    database_merger   merger(dbs, database, 2);
+    merger.exec_join(2);
+    EXPECT_FALSE(merger.full());
+    existing.reset();
+    insert_sequence(&database, hq, 1);
+    insert_sequence(&database, lqhq, 1);
+    insert_sequence(&database, lq, 0);
+    std::ofstream   os(database_file.path.c_str());
+    database_header header;
+    database.write(os, &header);
+  }
+
+  database_query database(database_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(database, hq, 2, 1, "hq", mer_map);
+  test_sequence(database, lqhq, 1, 1, "lqhq", mer_map);
+  test_sequence(database, lq, 1, 0, "lq", mer_map);
+}
+
+// Counts of 2 bits in the value array, the larger ones in the
+// overflow table
+TEST_P(MerDatabase, InlineBits) {
+  file_unlink database_file("mer_database_inline");
+  file_unlink mphf_file("mer_database_inline_mphf");
+
+  static const size_t       sequence_len = 10000;
+  static const unsigned int bits         = 7;
+  static const unsigned int inline_bits  = 2;
+  std::string hq1  = generate_sequence(sequence_len);
+  std::string hq5  = generate_sequence(sequence_len);
+  std::string lq3  = generate_sequence(sequence_len);
+  std::string lqhq = generate_sequence(sequence_len);
+  std::string many = generate_sequence(100);
+
+  // Two words per k-mer in the overflow table
+  mer_dna::k(33);
+
+  {
+    hash_with_quality database(GetParam() * 1000, mer_dna::k() * 2, bits, 10, 126, 0, database_header(),
+                               inline_bits);
+    std::vector<std::thread> threads;
+    threads.push_back(std::thread(insert_sequence, &database, hq1, 1));
+    for(int i = 0; i < 5; ++i)
+      threads.push_back(std::thread(insert_sequence, &database, hq5, 1));
+    for(int i = 0; i < 3; ++i)
+      threads.push_back(std::thread(insert_sequence, &database, lq3, 0));
+    // lqhq becomes high quality after its count overflows
+    for(int i = 0; i < 4; ++i)
+      insert_sequence(&database, lqhq, 0);
+    threads.push_back(std::thread(insert_sequence, &database, lqhq, 1));
+    for(auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+    for(int i = 0; i < 200; ++i)
+      insert_sequence(&database, many, 1);
+
+    std::ofstream   os(database_file.path.c_str());
+    database_header header;
+    database.write(os, &header);
+    EXPECT_TRUE(os.good());
+    EXPECT_EQ(bits, header.bits());
+    EXPECT_EQ(inline_bits, header.inline_bits());
+    EXPECT_LT((size_t)0, header.overflow_bytes());
+  }
+
+  // The overflow table does not depend on mer_dna::k() when opened
+  mer_dna::k(31);
+  database_query database(database_file.path.c_str());
+  mer_dna::k(33);
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(database, hq1, 1, 1, "hq1", mer_map);
+  test_sequence(database, hq5, 5, 1, "hq5", mer_map);
+  test_sequence(database, lq3, 3, 0, "lq3", mer_map);
+  test_sequence(database, lqhq, 1, 1, "lqhq", mer_map);
+  test_sequence(database, many, 127, 1, "many", mer_map);
+
+  // The cursors see the decoded values
+  size_t nb_mers = 0;
+  for(auto it = database.begin(); it != database.end(); ++it, ++nb_mers)
+    EXPECT_EQ(mer_map[*it->first], it->second);
+  EXPECT_EQ(mer_map.size(), nb_mers);
+  std::map<std::pair<uint64_t, int>, size_t> map_vals, cursor_vals;
+  for(auto it = mer_map.cbegin(); it != mer_map.cend(); ++it)
+    ++map_vals[it->second];
+  std::unique_ptr<database_backend::cursor> c(database.backend().new_cursor(false));
+  while(c->next())
+    ++cursor_vals[c->val()];
+  EXPECT_EQ(map_vals, cursor_vals);
+
+  // The converted database has the full counts
+  {
+    std::ofstream   os(mphf_file.path.c_str());
+    database_header header;
+    write_mphf_database(database.backend(), database.header().key_len(), database.header().bits(), os, header, 64);
+  }
+  database_query mphf(mphf_file.path.c_str());
+  for(auto it = mer_map.cbegin(); it != mer_map.cend(); ++it)
+    EXPECT_EQ(it->second, mphf[it->first]);
+}
+
+TEST_P(MerDatabase, Compact) {
+  file_unlink file("mer_database_compact");
+
+  static const size_t sequence_len = 1000;
+  std::string hq1 = generate_sequence(sequence_len);
+  std::string hq2 = generate_sequence(sequence_len);
+  std::string lq1 = generate_sequence(sequence_len);
+  std::string lq3 = generate_sequence(sequence_len);
+
+  mer_dna::k(31);
+
+  database_header header;
+  {
+    // Initial size too large, as after doublings
+    hash_with_quality database(16 * sequence_len, mer_dna::k() * 2, 5, 4);
+    insert_sequence(&database, hq1, 1);
+    for(int i = 0; i < 2; ++i)
+      insert_sequence(&database, hq2, 1);
+    insert_sequence(&database, lq1, 0);
+    for(int i = 0; i < 3; ++i)
+      insert_sequence(&database, lq3, 0);
+
+    const uint64_t min_count[2] = { 2, 1 };
+    database.compact(min_count, 0.8, GetParam());
+    std::ofstream os(file.path.c_str());
+    database.write(os, &header);
+    EXPECT_TRUE(os.good());
+  }
+  // Smallest table for the 3 kept sequences at a load of 0.8
+  const size_t nb_kept = 3 * (sequence_len - mer_dna::k() + 1);
+  EXPECT_LE(nb_kept, header.size() * 0.8);
+  EXPECT_GT(nb_kept, header.size() / 2 * 0.8);
+
+  database_query database(file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(database, hq1, 1, 1, "hq1", mer_map);
+  test_sequence(database, hq2, 2, 1, "hq2", mer_map);
+  test_sequence(database, lq1, 0, 0, "lq1", mer_map);
+  test_sequence(database, lq3, 3, 0, "lq3", mer_map);
+  size_t nb_mers = 0;
+  for(auto it = database.begin(); it != database.end(); ++it)
+    ++nb_mers;
+  EXPECT_EQ(nb_kept, nb_mers);
+}
+
+// With too little memory to double, the full table evicts the low
+// quality singletons instead
+TEST(MerDatabaseMaxMemory, Evict) {
+  file_unlink file("mer_database_evict");
+
+  static const size_t size = 1024;
+  std::string hq2 = generate_sequence(400);
+  std::string lq3 = generate_sequence(100);
+  std::vector<std::string> singletons;
+  for(int i = 0; i < 4; ++i)
+    singletons.push_back(generate_sequence(2000));
+
+  mer_dna::k(31);
+
+  database_header header;
+  {
+    hash_with_quality database(size, mer_dna::k() * 2, 5, 5);
+    database.max_memory(database.memory() * 5 / 2);
+    for(int i = 0; i < 2; ++i)
+      insert_sequence(&database, hq2, 1);
+    for(int i = 0; i < 3; ++i)
+      insert_sequence(&database, lq3, 0);
+    std::vector<std::thread> threads;
+    for(auto it = singletons.cbegin(); it != singletons.cend(); ++it)
+      threads.push_back(std::thread(insert_sequence, &database, *it, 0));
+    for(auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+    EXPECT_LT((size_t)0, database.evicted());
+
+    std::ofstream os(file.path.c_str());
+    database.write(os, &header);
+    EXPECT_TRUE(os.good());
+  }
+  EXPECT_EQ(size, header.size());
+
+  database_query database(file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(database, hq2, 2, 1, "hq2", mer_map);
+  test_sequence(database, lq3, 3, 0, "lq3", mer_map);
+  mer_dna m;
+  for(auto it = singletons.cbegin(); it != singletons.cend(); ++it) {
+    for(size_t i = 0; i <= it->size() - mer_dna::k(); ++i) {
+      m = it->substr(i, mer_dna::k());
+      const auto res = database[m];
+      EXPECT_TRUE(res == std::make_pair((uint64_t)0, 0) || res == std::make_pair((uint64_t)1, 0));
+    }
+  }
+}
+
+// Count the k-mers of seq in the sketch, and in the hash once their
+// count saturates the sketch.
+void insert_sketch(count_min_sketch* sketch, hash_with_quality* hash, const std::string& seq,
+                   const unsigned int quality) {
+  mer_dna m;
+  for(size_t i = 0; i <= seq.size() - mer_dna::k(); ++i) {
+    m = seq.substr(i, mer_dna::k());
+    if(!sketch->add(m, quality) && !hash->add(m, quality))
+      throw std::runtime_error("Hash is full");
+  }
+  hash->done();
+}
+
+// The counts of the sketch are never too low, rarely too high, and
+// exact for the heavy hitters
+TEST_P(MerDatabase, Sketch) {
+  file_unlink database_file("mer_database_sketch");
+
+  static const size_t       sequence_len = 100000;
+  static const unsigned int bits         = 10;
+  std::string hq    = generate_sequence(sequence_len);
+  std::string lq    = generate_sequence(sequence_len);
+  std::string heavy = generate_sequence(40);
+
+  mer_dna::k(31);
+
+  {
+    count_min_sketch  sketch(GetParam() * 16 * sequence_len);
+    hash_with_quality database(1024, mer_dna::k() * 2, bits, 1);
+    insert_sketch(&sketch, &database, hq, 1);
+    insert_sketch(&sketch, &database, hq, 1);
+    insert_sketch(&sketch, &database, lq, 0);
+    for(int i = 0; i < 300; ++i)
+      insert_sketch(&sketch, &database, heavy, 1);
+    std::ofstream   os(database_file.path.c_str());
+    database_header header;
+    database.write_sketch(os, sketch, &header);
+    EXPECT_TRUE(os.good());
+    EXPECT_EQ("sketch", header.layout());
+  }
+
+  database_query database(database_file.path.c_str());
+  std::map<mer_dna, std::pair<uint64_t, int> > mer_map;
+  test_sequence(database, heavy, 300, 1, "heavy", mer_map);
+
+  size_t  wrong_hq = 0, wrong_lq = 0;
+  mer_dna m;
+  for(size_t i = 0; i <= sequence_len - mer_dna::k(); ++i) {
+    m = hq.substr(i, mer_dna::k());
+    auto res = database[m];
+    EXPECT_EQ(1, res.second);
+    EXPECT_LE((uint64_t)2, res.first);
+    wrong_hq += res.first != 2;
+    m = lq.substr(i, mer_dna::k());
+    res = database[m];
+    EXPECT_LE((uint64_t)1, res.first);
+    wrong_lq += res != std::make_pair((uint64_t)1, 0);
+  }
+  EXPECT_GT(sequence_len * 3 / 100, wrong_hq);
+  EXPECT_GT(sequence_len * 3 / 100, wrong_lq);
+
+  // The sketch does not list the k-mers
+  EXPECT_THROW(database.begin(), std::runtime_error);
+
+  // The batched lookups agree
+  std::vector<mer_dna> mers(1000);
+  for(size_t i = 0; i < mers.size(); ++i)
+    mers[i] = (i % 2 ? hq : lq).substr(i, mer_dna::k());
+  std::vector<std::pair<uint64_t, int> > vals(mers.size());
+  database.get_batch(mers.data(), vals.data(), mers.size());
+  for(size_t i = 0; i < mers.size(); ++i)
+    EXPECT_EQ(database[mers[i]], vals[i]);
+}
+
+// A segment name with a '/' is a file, relative to the working
+// directory if not absolute. The second process attaches to it.
+TEST(SharedSegment, RelativePath) {
+  static const char data[] = "0123456789";
+  file_unlink data_file("shared_segment_data");
+  file_unlink segment_file("./shared_segment_test");
+  {
+    std::ofstream os(data_file.path.c_str());
+    os << data;
+  }
+
+  shared_segment creator(segment_file.path, data_file.path.c_str(), 1);
+  EXPECT_EQ(0, access("shared_segment_test", F_OK));
+  EXPECT_EQ(0, memcmp(data, creator.base(), sizeof(data) - 1));
+  shared_segment attacher(segment_file.path, data_file.path.c_str(), 1);
+  EXPECT_EQ(0, memcmp(data, attacher.base(), sizeof(data) - 1));
+}
+
 // Instantiate test for different size of mer databases
 INSTANTIATE_TEST_CASE_P(MerDatabaseTest, MerDatabase, ::testing::Values(1, 10, 20, 40));
 }
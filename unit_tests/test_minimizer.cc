@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <jellyfish/misc.hpp>
+#include <jellyfish/mer_dna.hpp>
+#include <src/minimizer.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+
+TEST(Minimizer, ReverseComplement) {
+  mer_dna::k(25);
+  const minimizer min(11);
+  mer_dna         m;
+  for(int i = 0; i < 1000; ++i) {
+    m.randomize();
+    EXPECT_EQ(min(m), min(m.get_reverse_complement()));
+  }
+}
+
+// The rolling window gives the minimizer of the last k-mer, and
+// restarts after a non-ACGT base.
+TEST(Minimizer, Window) {
+  static const char bases[] = "ACGTN";
+  mer_dna::k(21);
+  const minimizer  min(9);
+  minimizer_window window(min, mer_dna::k());
+  mer_dna          m;
+  unsigned int     len = 0;
+
+  for(int i = 0; i < 5000; ++i) {
+    const char base = bases[jellyfish::random_bits(7) % (i % 500 < 10 ? 5 : 4)];
+    const int  code = mer_dna::code(base);
+    if(mer_dna::not_dna(code)) {
+      window.reset();
+      len = 0;
+      continue;
+    }
+    m.shift_left(code);
+    ++len;
+    ASSERT_EQ(len >= mer_dna::k(), window.push(code));
+    if(len >= mer_dna::k()) {
+      ASSERT_EQ(min(m), window.value());
+    }
+  }
+}
+}
@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include <jellyfish/misc.hpp>
+#include <jellyfish/mer_dna.hpp>
+#include <src/read_encoder.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+
+TEST(ReadEncoder, Base) {
+  static const char bases[] = "ACGTacgtNn.-";
+  for(const char* b = bases; *b; ++b) {
+    SCOPED_TRACE(::testing::Message() << "base:" << *b);
+    const int     code = mer_dna::code(*b);
+    const uint8_t c    = read_encoding::encode_base(*b, 'I', '5');
+    if(mer_dna::not_dna(code)) {
+      EXPECT_EQ(read_encoding::not_dna, c);
+    } else {
+      EXPECT_EQ(code, c & read_encoding::code_mask);
+      EXPECT_EQ(read_encoding::high, c & read_encoding::high);
+      EXPECT_EQ(0, read_encoding::encode_base(*b, '4', '5') & read_encoding::high);
+    }
+  }
+}
+
+// The vectorized encoders agree with the scalar one for any length
+TEST(ReadEncoder, Vectorized) {
+  static const char bases[] = "ACGTacgtN";
+  for(size_t len = 0; len < 200; ++len) {
+    SCOPED_TRACE(::testing::Message() << "len:" << len);
+    std::string seq(len, 'A'), qual(len, 'I');
+    for(size_t i = 0; i < len; ++i) {
+      seq[i]  = bases[jellyfish::random_bits(8) % 9];
+      qual[i] = '!' + jellyfish::random_bits(6) % 42;
+    }
+    const char           thresh = '!' + jellyfish::random_bits(6) % 42;
+    std::vector<uint8_t> expected(len), actual(len);
+    read_encoding::encode_scalar(seq.data(), qual.data(), len, thresh, expected.data());
+    read_encoding::encode(seq.data(), qual.data(), len, thresh, actual.data());
+    EXPECT_EQ(expected, actual);
+#ifdef __SSE2__
+    read_encoding::encode_sse2(seq.data(), qual.data(), len, thresh, actual.data());
+    EXPECT_EQ(expected, actual);
+#endif
+#ifdef QUORUM_HAVE_AVX2_TARGET
+    if(read_encoding::have_avx2()) {
+      read_encoding::encode_avx2(seq.data(), qual.data(), len, thresh, actual.data());
+      EXPECT_EQ(expected, actual);
+    }
+#endif
+  }
+}
+}
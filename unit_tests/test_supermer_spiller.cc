@@ -0,0 +1,89 @@
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <unit_tests/test_misc.hpp>
+#include <src/supermer_spiller.hpp>
+#include <jellyfish/mer_dna.hpp>
+#include <jellyfish/misc.hpp>
+
+namespace {
+using jellyfish::mer_dna;
+
+// Each k-mer of the reads, with its qualities, and its number of
+// occurrences
+typedef std::map<std::pair<std::string, std::string>, int> mer_counts;
+
+void add_mers(mer_counts& counts, const std::string& seq, const std::string& quals) {
+  size_t len = 0;
+  for(size_t i = 0; i < seq.size(); ++i) {
+    len = mer_dna::not_dna(mer_dna::code(seq[i])) ? 0 : len + 1;
+    if(len >= mer_dna::k())
+      ++counts[std::make_pair(seq.substr(i + 1 - mer_dna::k(), mer_dna::k()),
+                              quals.substr(i + 1 - mer_dna::k(), mer_dna::k()))];
+  }
+}
+
+// Spill random reads, in fasta or fastq, into partitions. Every k-mer
+// of the reads must be in exactly one partition, with its qualities
+// (none in fasta: all low).
+void check_partitions(bool fasta) {
+  static const char   bases[]  = "ACGTN";
+  static const size_t nb_parts = 4;
+  mer_dna::k(21);
+  const minimizer min(9);
+
+  file_unlink reads_file(fasta ? "supermer_reads.fa" : "supermer_reads.fq");
+  mer_counts  expected;
+  {
+    std::ofstream os(reads_file.path.c_str());
+    for(int i = 0; i < 200; ++i) {
+      std::string seq, quals;
+      for(int j = 0; j < 150; ++j) {
+        seq   += bases[jellyfish::random_bits(7) % (j % 50 < 2 ? 5 : 4)];
+        quals += (char)('!' + jellyfish::random_bits(5));
+      }
+      if(fasta) {
+        os << ">" << i << "\n" << seq << "\n";
+        quals.assign(seq.size(), '\0');
+      } else {
+        os << "@" << i << "\n" << seq << "\n+\n" << quals << "\n";
+      }
+      add_mers(expected, seq, quals);
+    }
+  }
+
+  std::vector<std::string>                   paths;
+  std::vector<std::unique_ptr<file_unlink> > part_files;
+  for(size_t p = 0; p < nb_parts; ++p) {
+    paths.push_back(reads_file.path + ".part" + std::to_string(p));
+    part_files.push_back(std::unique_ptr<file_unlink>(new file_unlink(paths.back())));
+  }
+  {
+    const supermer_spiller::file_vector files(1, reads_file.path.c_str());
+    supermer_spiller::stream_manager    streams(files.cbegin(), files.cend(), 1);
+    supermer_spiller                    spiller(2, streams, min, paths);
+    spiller.exec_join(2);
+    spiller.close();
+  }
+
+  mer_counts actual;
+  for(size_t p = 0; p < nb_parts; ++p) {
+    std::ifstream is(paths[p].c_str());
+    std::string   header, seq, sep, quals;
+    while(std::getline(is, header) && std::getline(is, seq) && std::getline(is, sep) && std::getline(is, quals)) {
+      ASSERT_EQ(seq.size(), quals.size());
+      add_mers(actual, seq, quals);
+    }
+  }
+  EXPECT_EQ(expected, actual);
+}
+
+TEST(SupermerSpiller, Fastq) { check_partitions(false); }
+TEST(SupermerSpiller, Fasta) { check_partitions(true); }
+}